@@ -0,0 +1,72 @@
+#include "alloccounter.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Per thread, so the conversion threads do not contend on a shared counter
+thread_local uint64_t thread_allocations = 0;
+
+}
+
+uint64_t threadAllocationCount() {
+    return thread_allocations;
+}
+
+void countAllocation() {
+    thread_allocations++;
+}
+
+void *operator new(std::size_t size) {
+    thread_allocations++;
+    if (size == 0) size = 1;
+    for (;;) {
+        void *p = std::malloc(size);
+        if (p) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return operator new(size);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    std::free(p);
+}
@@ -0,0 +1,14 @@
+#ifndef ALLOCCOUNTER_H_
+#define ALLOCCOUNTER_H_
+
+#include <cstdint>
+
+/// Heap allocations made through operator new on the calling thread so far. The global operator
+/// new is replaced in alloccounter.cpp to count them. Allocations made by C libraries (HDF5, the
+/// ISMRMRD C API) bypass it, callers record the ones they can observe with countAllocation.
+uint64_t threadAllocationCount();
+
+/// Records an allocation operator new did not see on the calling thread
+void countAllocation();
+
+#endif //ALLOCCOUNTER_H_
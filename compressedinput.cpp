@@ -0,0 +1,297 @@
+#include "compressedinput.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include "pipeline.h"
+
+namespace {
+
+const unsigned char GZIP_MAGIC[2] = {0x1f, 0x8b};
+const uint32_t ZSTD_MAGIC = 0xFD2FB528;
+const uint32_t ZSTD_SKIPPABLE_MAGIC = 0x184D2A50; // The lowest 4 bits are free
+const uint8_t GZIP_FEXTRA = 4;
+
+// Independent members or frames are collected into batches of about this compressed size
+const size_t COMPRESSED_BATCH_SIZE = 4 << 20;
+// Frames that decompress to more than this are streamed rather than held in memory at once
+const uint64_t MAX_UNIT_SIZE = 64 << 20;
+// Size of the decompressed chunks when streaming
+const size_t STREAM_CHUNK_SIZE = 4 << 20;
+// Decompressed chunks queued ahead of the decoder
+const size_t QUEUE_DEPTH = 8;
+
+uint64_t readLittleEndian(const unsigned char *p, size_t n) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++) value |= (uint64_t) p[i] << (8 * i);
+    return value;
+}
+
+bool readExactly(std::istream &file, std::vector<char> &out, size_t n) {
+    size_t old_size = out.size();
+    out.resize(old_size + n);
+    file.read(out.data() + old_size, n);
+    return (size_t) file.gcount() == n;
+}
+
+}
+
+Compression detectCompression(const std::string &filename) {
+    std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
+    unsigned char magic[4];
+    if (!f.read(reinterpret_cast<char *>(magic), sizeof(magic))) return Compression::NONE;
+
+    if (magic[0] == GZIP_MAGIC[0] && magic[1] == GZIP_MAGIC[1]) return Compression::GZIP;
+    if (readLittleEndian(magic, 4) == ZSTD_MAGIC) return Compression::ZSTD;
+    return Compression::NONE;
+}
+
+std::string compressionName(Compression compression) {
+    switch (compression) {
+        case Compression::GZIP:
+            return "gzip";
+        case Compression::ZSTD:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+#ifndef _WIN32
+
+struct CompressedInputBuf::Batch {
+    std::vector<char> compressed;
+    std::vector<size_t> unit_ends; // End of every member or frame in compressed
+    std::vector<char> decompressed;
+};
+
+CompressedInputBuf::CompressedInputBuf(const std::string &filename, Compression compression, unsigned int threads)
+    : PipeInputBuf(-1), compression_(compression), front_position_(0), done_(false), stopping_(false) {
+    {
+        std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
+        if (!f) throw std::runtime_error("Failed to open " + filename);
+    }
+    producer_ = std::thread(&CompressedInputBuf::produce, this, filename, threads);
+}
+
+CompressedInputBuf::~CompressedInputBuf() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    not_full_.notify_all();
+    producer_.join();
+}
+
+size_t CompressedInputBuf::readSome(char *buffer, size_t n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() { return !chunks_.empty() || done_; });
+    if (chunks_.empty()) {
+        if (!error_.empty()) throw std::runtime_error("Failed to decompress the input: " + error_);
+        return 0;
+    }
+
+    std::vector<char> &chunk = chunks_.front();
+    size_t got = std::min(n, chunk.size() - front_position_);
+    memcpy(buffer, chunk.data() + front_position_, got);
+    front_position_ += got;
+    if (front_position_ == chunk.size()) {
+        chunks_.pop_front();
+        front_position_ = 0;
+        not_full_.notify_one();
+    }
+    return got;
+}
+
+bool CompressedInputBuf::push(std::vector<char> &&chunk) {
+    if (chunk.empty()) return true;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return chunks_.size() < QUEUE_DEPTH || stopping_; });
+    if (stopping_) return false;
+    chunks_.push_back(std::move(chunk));
+    not_empty_.notify_one();
+    return true;
+}
+
+void CompressedInputBuf::decompressUnit(const char *data, size_t size, std::vector<char> &out) const {
+    namespace io = boost::iostreams;
+    io::filtering_istream in;
+    if (compression_ == Compression::GZIP) {
+        in.push(io::gzip_decompressor());
+    } else {
+        in.push(io::zstd_decompressor());
+    }
+    in.push(io::array_source(data, size));
+    in.exceptions(std::ios::badbit);
+
+    while (in) {
+        size_t old_size = out.size();
+        out.resize(old_size + STREAM_CHUNK_SIZE);
+        in.read(out.data() + old_size, STREAM_CHUNK_SIZE);
+        out.resize(old_size + in.gcount());
+    }
+}
+
+bool CompressedInputBuf::readUnit(std::istream &file, Batch &batch) {
+    std::streampos start = file.tellg();
+    size_t batch_size = batch.compressed.size();
+
+    auto give_up = [&]() {
+        batch.compressed.resize(batch_size);
+        file.clear();
+        file.seekg(start);
+        return false;
+    };
+
+    if (compression_ == Compression::GZIP) {
+        // Only members carrying their size in a BGZF style "BC" extra field can be split off
+        if (!readExactly(file, batch.compressed, 12)) return give_up();
+        const unsigned char *header = reinterpret_cast<const unsigned char *>(batch.compressed.data() + batch_size);
+        if (header[0] != GZIP_MAGIC[0] || header[1] != GZIP_MAGIC[1] || !(header[3] & GZIP_FEXTRA)) {
+            return give_up();
+        }
+
+        size_t extra_length = readLittleEndian(header + 10, 2);
+        if (!readExactly(file, batch.compressed, extra_length)) return give_up();
+        const unsigned char *extra = reinterpret_cast<const unsigned char *>(batch.compressed.data() + batch_size + 12);
+
+        uint64_t member_size = 0;
+        for (size_t i = 0; i + 4 <= extra_length;) {
+            size_t field_length = readLittleEndian(extra + i + 2, 2);
+            if (extra[i] == 'B' && extra[i + 1] == 'C' && field_length == 2 && i + 6 <= extra_length) {
+                member_size = readLittleEndian(extra + i + 4, 2) + 1;
+            }
+            i += 4 + field_length;
+        }
+        if (member_size < 12 + extra_length) return give_up();
+        if (!readExactly(file, batch.compressed, member_size - 12 - extra_length)) return give_up();
+    } else {
+        unsigned char magic[4];
+        for (;;) {
+            if (!file.read(reinterpret_cast<char *>(magic), 4)) return give_up();
+            if ((readLittleEndian(magic, 4) & 0xFFFFFFF0) != ZSTD_SKIPPABLE_MAGIC) break;
+
+            // Skippable frames (e.g. the frame sizes pzstd writes) carry no data
+            unsigned char size[4];
+            if (!file.read(reinterpret_cast<char *>(size), 4)) return give_up();
+            file.seekg(readLittleEndian(size, 4), std::ios::cur);
+            start = file.tellg();
+        }
+        if (readLittleEndian(magic, 4) != ZSTD_MAGIC) return give_up();
+        batch.compressed.insert(batch.compressed.end(), magic, magic + 4);
+
+        // Frame header: descriptor, window descriptor, dictionary id and content size
+        if (!readExactly(file, batch.compressed, 1)) return give_up();
+        uint8_t descriptor = batch.compressed.back();
+        unsigned int content_size_flag = descriptor >> 6;
+        bool single_segment = descriptor & 0x20;
+        bool checksum = descriptor & 0x04;
+        const size_t dictionary_id_sizes[4] = {0, 1, 2, 4};
+        const size_t content_size_sizes[4] = {0, 2, 4, 8};
+        size_t content_size_length = content_size_sizes[content_size_flag];
+        if (content_size_flag == 0 && single_segment) content_size_length = 1;
+        size_t header_length = (single_segment ? 0 : 1) + dictionary_id_sizes[descriptor & 3] + content_size_length;
+        if (!readExactly(file, batch.compressed, header_length)) return give_up();
+
+        // Frames of unknown or very large content size are streamed
+        if (content_size_length == 0) return give_up();
+        const unsigned char *content_size = reinterpret_cast<const unsigned char *>(
+            batch.compressed.data() + batch.compressed.size() - content_size_length);
+        uint64_t frame_content_size = readLittleEndian(content_size, content_size_length);
+        if (content_size_length == 2) frame_content_size += 256;
+        if (frame_content_size > MAX_UNIT_SIZE) return give_up();
+
+        // Walk the blocks up to the last one
+        bool last_block = false;
+        while (!last_block) {
+            if (!readExactly(file, batch.compressed, 3)) return give_up();
+            uint32_t block_header = readLittleEndian(
+                reinterpret_cast<const unsigned char *>(batch.compressed.data() + batch.compressed.size() - 3), 3);
+            last_block = block_header & 1;
+            unsigned int block_type = (block_header >> 1) & 3;
+            size_t block_size = block_header >> 3;
+            if (block_type == 1) block_size = 1; // RLE block, a single byte repeated
+            if (block_type == 3 || !readExactly(file, batch.compressed, block_size)) return give_up();
+        }
+        if (checksum && !readExactly(file, batch.compressed, 4)) return give_up();
+    }
+
+    batch.unit_ends.push_back(batch.compressed.size());
+    return true;
+}
+
+void CompressedInputBuf::produce(const std::string &filename, unsigned int threads) {
+    try {
+        std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+        bool splitting = true;
+
+        auto read_batch = [&](Batch &batch) -> bool {
+            batch.compressed.clear();
+            batch.unit_ends.clear();
+            while (splitting && batch.compressed.size() < COMPRESSED_BATCH_SIZE) {
+                if (file.peek() == std::char_traits<char>::eof()) {
+                    splitting = false;
+                } else if (!readUnit(file, batch)) {
+                    splitting = false;
+                }
+            }
+            return !batch.unit_ends.empty();
+        };
+
+        auto decompress_batch = [&](Batch &batch) {
+            batch.decompressed.clear();
+            size_t begin = 0;
+            for (size_t end : batch.unit_ends) {
+                decompressUnit(batch.compressed.data() + begin, end - begin, batch.decompressed);
+                begin = end;
+            }
+        };
+
+        auto write_batch = [&](Batch &batch) -> bool {
+            return push(std::move(batch.decompressed));
+        };
+
+        runPipeline<Batch>(threads, 2 * threads, read_batch, decompress_batch, write_batch);
+
+        // Whatever could not be split is decompressed in one go
+        file.clear();
+        if (file.peek() != std::char_traits<char>::eof()) {
+            namespace io = boost::iostreams;
+            io::filtering_istream in;
+            if (compression_ == Compression::GZIP) {
+                in.push(io::gzip_decompressor());
+            } else {
+                in.push(io::zstd_decompressor());
+            }
+            in.push(file);
+            in.exceptions(std::ios::badbit);
+
+            while (in) {
+                std::vector<char> chunk(STREAM_CHUNK_SIZE);
+                in.read(chunk.data(), chunk.size());
+                chunk.resize(in.gcount());
+                if (!push(std::move(chunk))) break;
+            }
+        }
+    }
+    catch (const std::exception &e) {
+        // The stream only sees a failed read, say why
+        std::cerr << "ERROR: Failed to decompress the input: " << e.what() << std::endl;
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = e.what();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    not_empty_.notify_all();
+}
+
+#endif
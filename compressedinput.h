@@ -0,0 +1,69 @@
+#ifndef COMPRESSEDINPUT_H_
+#define COMPRESSEDINPUT_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "datinput.h"
+
+enum class Compression : int {
+    NONE,
+    GZIP,
+    ZSTD
+};
+
+/// Tells the compression of a file from its magic number
+Compression detectCompression(const std::string &filename);
+
+std::string compressionName(Compression compression);
+
+/// Forward-only input decompressing a gzip or zstd compressed dat file on background threads.
+///
+/// Files made of many independent members or frames of known size (bgzip, pzstd) are split into
+/// batches that are decompressed concurrently on the given number of threads and handed out in order.
+/// A member or frame that can not be split off without decompressing it (plain gzip, a single
+/// zstd frame) is decompressed as a stream on one background thread from there on.
+class CompressedInputBuf : public PipeInputBuf {
+public:
+    CompressedInputBuf(const std::string &filename, Compression compression, unsigned int threads);
+    ~CompressedInputBuf() override;
+
+protected:
+    size_t readSome(char *buffer, size_t n) override;
+    bool sizeKnown() const override { return false; }
+
+private:
+    struct Batch;
+
+    /// Decompresses the whole file, runs on producer_
+    void produce(const std::string &filename, unsigned int threads);
+
+    /// Reads the next independent member or frame into batch. Returns false, leaving the file
+    /// at the start of it, if its compressed size can not be told from its headers.
+    bool readUnit(std::istream &file, Batch &batch);
+
+    void decompressUnit(const char *data, size_t size, std::vector<char> &out) const;
+
+    /// Queues decompressed data for readSome, waits while the queue is full. Returns false when shutting down.
+    bool push(std::vector<char> &&chunk);
+
+    Compression compression_;
+
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<std::vector<char>> chunks_;
+    size_t front_position_; // Bytes of chunks_.front() handed out already
+    bool done_;
+    bool stopping_;
+    std::string error_;
+
+    std::thread producer_;
+};
+
+#endif //COMPRESSEDINPUT_H_
@@ -0,0 +1,750 @@
+#include "datinput.h"
+#include "compressedinput.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+#include <chrono>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+IoBackend parseIoBackend(const std::string &name) {
+    if (name == "stream") return IoBackend::STREAM;
+    if (name == "mmap") return IoBackend::MMAP;
+    if (name == "uring") return IoBackend::URING;
+    if (name == "direct") return IoBackend::DIRECT;
+    throw std::runtime_error("Unknown I/O backend: " + name + " (expected stream, mmap, uring or direct)");
+}
+
+std::string ioBackendName(IoBackend backend) {
+    switch (backend) {
+        case IoBackend::MMAP:
+            return "mmap";
+        case IoBackend::URING:
+            return "uring";
+        case IoBackend::DIRECT:
+            return "direct";
+        default:
+            return "stream";
+    }
+}
+
+namespace {
+
+// Consumed input is dropped from the page cache in steps of this size
+const uint64_t PAGE_CACHE_DROP_STEP = 64 << 20;
+
+}
+
+PageCacheDropper::PageCacheDropper() : fd_(-1), mapping_(nullptr), mapping_size_(0), dropped_(0) {
+}
+
+PageCacheDropper::~PageCacheDropper() {
+#ifndef _WIN32
+    if (fd_ >= 0) close(fd_);
+#endif
+}
+
+void PageCacheDropper::open(const std::string &filename, const char *mapping, uint64_t mapping_size) {
+#ifndef _WIN32
+    if (fd_ >= 0) close(fd_);
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    mapping_ = mapping;
+    mapping_size_ = mapping_size;
+    dropped_ = 0;
+#endif
+}
+
+void PageCacheDropper::dropBefore(uint64_t offset) {
+#ifndef _WIN32
+    if (fd_ < 0 || offset < dropped_ + PAGE_CACHE_DROP_STEP) return;
+
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t end = offset - offset % page_size;
+    // Mapped pages stay in the page cache until they are unmapped
+    if (mapping_ && dropped_ < mapping_size_) {
+        madvise(const_cast<char *>(mapping_) + dropped_, std::min(end, mapping_size_) - dropped_, MADV_DONTNEED);
+    }
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd_, dropped_, end - dropped_, POSIX_FADV_DONTNEED);
+#endif
+    dropped_ = end;
+#endif
+}
+
+const char *DatInputBuf::view(std::streamsize n) {
+    if (egptr() - gptr() < n) return nullptr;
+
+    const char *p = gptr();
+    setg(eback(), gptr() + n, egptr());
+    return p;
+}
+
+MappedFileBuf::MappedFileBuf(const std::string &filename) {
+    mapping_.open(filename);
+
+    // mapped_file_source is read-only, the const_cast is only needed to satisfy the streambuf interface
+    char *begin = const_cast<char *>(mapping_.data());
+    setg(begin, begin, begin + mapping_.size());
+}
+
+void MappedFileBuf::dropCacheBehind(const std::string &filename) {
+#ifndef _WIN32
+    madvise(const_cast<char *>(mapping_.data()), mapping_.size(), MADV_SEQUENTIAL);
+#endif
+    dropper_.open(filename, mapping_.data(), mapping_.size());
+}
+
+MappedFileBuf::pos_type
+MappedFileBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+        base = gptr() - eback();
+    } else if (dir == std::ios_base::end) {
+        base = egptr() - eback();
+    }
+
+    off_type pos = base + off;
+    if (pos < 0 || pos > egptr() - eback()) return pos_type(off_type(-1));
+
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+}
+
+MappedFileBuf::pos_type MappedFileBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+std::streamsize MappedFileBuf::showmanyc() {
+    std::streamsize avail = egptr() - gptr();
+    return avail > 0 ? avail : -1;
+}
+
+std::streamsize MappedFileBuf::xsgetn(char_type *s, std::streamsize n) {
+    std::streamsize avail = egptr() - gptr();
+    if (n > avail) n = avail;
+    if (n > 0) {
+        memcpy(s, gptr(), n);
+        // gbump() takes an int, files are larger than that
+        setg(eback(), gptr() + n, egptr());
+    }
+    return n;
+}
+
+const char *readBlock(std::istream &is, std::streamsize n, std::vector<char> &buffer, bool persistent) {
+    DatInputBuf *buf = dynamic_cast<DatInputBuf *>(is.rdbuf());
+    if (buf && is.good() && n > 0 && (!persistent || buf->persistentViews())) {
+        const char *p = buf->view(n);
+        if (p) return p;
+    }
+
+    if ((std::streamsize) buffer.size() < n) buffer.resize(n);
+    is.read(buffer.data(), n);
+    return buffer.data();
+}
+
+#ifndef _WIN32
+
+WindowedFileBuf::WindowedFileBuf(int fd) : fd_(fd), window_offset_(0) {
+    setg(nullptr, nullptr, nullptr);
+}
+
+WindowedFileBuf::~WindowedFileBuf() {
+    if (fd_ >= 0) close(fd_);
+}
+
+void WindowedFileBuf::dropCacheBehind(const std::string &filename) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    dropper_.open(filename);
+}
+
+void WindowedFileBuf::setWindow(uint64_t offset, char *begin, size_t length, size_t position) {
+    window_offset_ = offset;
+    setg(begin, begin + position, begin + length);
+}
+
+WindowedFileBuf::int_type WindowedFileBuf::underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+    if (!fetchWindow(window_offset_ + (egptr() - eback())) || gptr() == egptr()) return traits_type::eof();
+    return traits_type::to_int_type(*gptr());
+}
+
+WindowedFileBuf::pos_type
+WindowedFileBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+        base = window_offset_ + (gptr() - eback());
+    } else if (dir == std::ios_base::end) {
+        if (!sizeKnown()) return pos_type(off_type(-1));
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) return pos_type(off_type(-1));
+        base = st.st_size;
+    }
+
+    off_type pos = base + off;
+    if (pos < 0) return pos_type(off_type(-1));
+
+    if ((uint64_t) pos >= window_offset_ && (uint64_t) pos <= window_offset_ + (egptr() - eback())) {
+        setg(eback(), eback() + (pos - window_offset_), egptr());
+    } else if ((uint64_t) pos < window_offset_ && !seekable()) {
+        return pos_type(off_type(-1));
+    } else {
+        discard();
+        // Empty get area at the new position, the next read fetches the window there
+        setWindow(pos, nullptr, 0);
+    }
+    return pos_type(pos);
+}
+
+WindowedFileBuf::pos_type WindowedFileBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+std::streamsize WindowedFileBuf::xsgetn(char_type *s, std::streamsize n) {
+    std::streamsize done = 0;
+    while (done < n) {
+        std::streamsize avail = egptr() - gptr();
+        if (avail == 0) {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+            continue;
+        }
+        std::streamsize chunk = std::min(avail, n - done);
+        memcpy(s + done, gptr(), chunk);
+        setg(eback(), gptr() + chunk, egptr());
+        done += chunk;
+    }
+    return done;
+}
+
+SequentialFileBuf::SequentialFileBuf(const std::string &filename, size_t window_size)
+    : WindowedFileBuf(::open(filename.c_str(), O_RDONLY)), buffer_(window_size) {
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open " + filename + ": " + strerror(errno));
+    }
+}
+
+bool SequentialFileBuf::fetchWindow(uint64_t offset) {
+    ssize_t got;
+    do {
+        got = ::pread(fd_, buffer_.data(), buffer_.size(), offset);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) throw std::runtime_error(std::string("Failed to read the input: ") + strerror(errno));
+    if (got == 0) return false;
+
+    setWindow(offset, buffer_.data(), got);
+    return true;
+}
+
+std::mutex AlignedBufferPool::mutex_;
+std::vector<AlignedBufferPool::FreeBuffer> AlignedBufferPool::free_;
+
+std::shared_ptr<char> AlignedBufferPool::acquire(size_t size) {
+    char *data = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = free_.begin(); it != free_.end(); ++it) {
+            if (it->size >= size) {
+                data = it->data;
+                size = it->size;
+                free_.erase(it);
+                break;
+            }
+        }
+    }
+    if (!data) {
+        void *p;
+        if (posix_memalign(&p, ALIGNMENT, size) != 0) throw std::bad_alloc();
+        data = static_cast<char *>(p);
+    }
+    return std::shared_ptr<char>(data, [size](char *p) { release(p, size); });
+}
+
+void AlignedBufferPool::release(char *data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(FreeBuffer{size, data});
+}
+
+DirectFileBuf::DirectFileBuf(const std::string &filename, size_t window_size)
+    : WindowedFileBuf(-1), window_size_(window_size) {
+#if defined(O_DIRECT)
+    fd_ = ::open(filename.c_str(), O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ >= 0 && fcntl(fd_, F_NOCACHE, 1) != 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+#else
+    errno = ENOTSUP;
+#endif
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open " + filename + " for direct I/O: " + strerror(errno));
+    }
+    buffer_ = AlignedBufferPool::acquire(window_size_);
+}
+
+bool DirectFileBuf::fetchWindow(uint64_t offset) {
+    // Direct reads have to start at an aligned offset, the window covers the bytes before offset too
+    uint64_t aligned_offset = offset - offset % AlignedBufferPool::ALIGNMENT;
+    ssize_t got;
+    for (;;) {
+        got = ::pread(fd_, buffer_.get(), window_size_, aligned_offset);
+        if (got >= 0) break;
+        int error = errno;
+        if (error == EINTR) continue;
+#ifdef O_DIRECT
+        int flags = fcntl(fd_, F_GETFL);
+        if (error == EINVAL && flags >= 0 && (flags & O_DIRECT)) {
+            // Some file systems accept O_DIRECT on open but not on reads
+            std::cerr << "WARNING: The file system does not support direct I/O, falling back to buffered reads."
+                      << std::endl;
+            if (fcntl(fd_, F_SETFL, flags & ~O_DIRECT) == 0) continue;
+        }
+#endif
+        throw std::runtime_error(std::string("Failed to read the input: ") + strerror(error));
+    }
+    if ((uint64_t) got <= offset - aligned_offset) return false;
+
+    setWindow(aligned_offset, buffer_.get(), got, offset - aligned_offset);
+    return true;
+}
+
+PipeInputBuf::PipeInputBuf(int fd, size_t window_size, size_t history)
+    : WindowedFileBuf(fd), buffer_(history + window_size), window_size_(window_size), history_(history),
+      consumed_(0), buffered_(0) {
+}
+
+bool PipeInputBuf::fetchWindow(uint64_t offset) {
+    if (offset < consumed_) return false;
+
+    // Keep the last bytes read for short backward seeks
+    size_t kept = std::min(history_, buffered_);
+    memmove(buffer_.data(), buffer_.data() + buffered_ - kept, kept);
+
+    // Forward seek, drop everything up to offset
+    while (consumed_ < offset) {
+        size_t got = readSome(buffer_.data() + kept, std::min<uint64_t>(window_size_, offset - consumed_));
+        if (got == 0) return false;
+        consumed_ += got;
+
+        size_t total = kept + got;
+        kept = std::min(history_, total);
+        memmove(buffer_.data(), buffer_.data() + total - kept, kept);
+    }
+
+    // Hand out whatever the pipe has, so decoding keeps pace with the transfer
+    size_t got = readSome(buffer_.data() + kept, window_size_);
+    if (got == 0) return false;
+
+    consumed_ += got;
+    buffered_ = kept + got;
+    setWindow(offset - kept, buffer_.data(), kept + got, kept);
+    return true;
+}
+
+size_t PipeInputBuf::readSome(char *buffer, size_t n) {
+    ssize_t got;
+    do {
+        got = ::read(fd_, buffer, n);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) throw std::runtime_error(std::string("Failed to read the input: ") + strerror(errno));
+    return got;
+}
+
+FollowFileBuf::FollowFileBuf(const std::string &filename, unsigned int idle_timeout, size_t window_size)
+    : WindowedFileBuf(::open(filename.c_str(), O_RDONLY)), buffer_(window_size), window_size_(window_size),
+      idle_timeout_(idle_timeout), inotify_fd_(-1) {
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open " + filename + ": " + strerror(errno));
+    }
+#ifdef __linux__
+    // Without inotify (or on file systems that do not report changes) the file size is polled
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ >= 0 && inotify_add_watch(inotify_fd_, filename.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+        close(inotify_fd_);
+        inotify_fd_ = -1;
+    }
+#endif
+}
+
+FollowFileBuf::~FollowFileBuf() {
+    if (inotify_fd_ >= 0) close(inotify_fd_);
+}
+
+bool FollowFileBuf::fetchWindow(uint64_t offset) {
+    for (;;) {
+        ssize_t got = ::pread(fd_, buffer_.data(), window_size_, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) throw std::runtime_error(std::string("Failed to read the input: ") + strerror(errno));
+        if (got > 0) {
+            // Hand out what is there already, the rest is waited for on the next fetch
+            setWindow(offset, buffer_.data(), got);
+            return true;
+        }
+        if (!waitForGrowth(offset)) return false;
+    }
+}
+
+bool FollowFileBuf::waitForGrowth(uint64_t size) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(idle_timeout_);
+    for (;;) {
+        struct stat st;
+        if (fstat(fd_, &st) != 0) return false;
+        if ((uint64_t) st.st_size > size) return true;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            std::cerr << "WARNING: The input has not grown for " << idle_timeout_ << " seconds, stopping."
+                      << std::endl;
+            return false;
+        }
+
+        // Wake up on a change notification, but check the size at least every 100 ms in case it is missed
+        int wait_ms = (int) std::min<long long>(
+            100, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1);
+        if (inotify_fd_ >= 0) {
+            struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+            if (poll(&pfd, 1, wait_ms) > 0) {
+                char events[4096];
+                while (::read(inotify_fd_, events, sizeof(events)) > 0) {
+                }
+            }
+        } else {
+            usleep(wait_ms * 1000);
+        }
+    }
+}
+
+struct ReadaheadFileBuf::Window {
+    std::vector<char> buffer;
+    struct iovec iov;
+    uint64_t offset;
+    bool pending;
+    int result;
+};
+
+ReadaheadFileBuf::ReadaheadFileBuf(const std::string &filename, size_t window_size, unsigned int depth)
+    : WindowedFileBuf(-1), windows_(std::max(depth, 2u)), window_size_(window_size), first_(0), in_flight_(0),
+      next_read_offset_(0), file_size_(0) {
+    ring_.reset(new IoUring(windows_.size()));
+
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open " + filename + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd_, &st) == 0) file_size_ = st.st_size;
+
+    for (auto &window : windows_) {
+        window.buffer.resize(window_size_);
+        window.iov.iov_base = window.buffer.data();
+        window.iov.iov_len = window_size_;
+        window.pending = false;
+    }
+}
+
+ReadaheadFileBuf::~ReadaheadFileBuf() {
+    try {
+        discard();
+    }
+    catch (...) {
+    }
+}
+
+void ReadaheadFileBuf::submitNext() {
+    Window &window = windows_[(first_ + in_flight_) % windows_.size()];
+    window.offset = next_read_offset_;
+    window.pending = true;
+    ring_->queueRead(fd_, &window.iov, window.offset, (first_ + in_flight_) % windows_.size());
+    next_read_offset_ += window_size_;
+    in_flight_++;
+}
+
+void ReadaheadFileBuf::waitFor(Window &window) {
+    while (window.pending) {
+        uint64_t index;
+        int res;
+        ring_->waitCompletion(index, res);
+        windows_[index].pending = false;
+        windows_[index].result = res;
+    }
+}
+
+void ReadaheadFileBuf::discard() {
+    // The kernel still writes into the buffers of reads in flight, wait for all of them
+    for (auto &window : windows_) waitFor(window);
+    in_flight_ = 0;
+    setg(nullptr, nullptr, nullptr);
+}
+
+bool ReadaheadFileBuf::fetchWindow(uint64_t offset) {
+    if (offset >= file_size_) return false;
+
+    // The window holding the get area is consumed, move on to the next one in flight
+    if (eback() && in_flight_ > 0) {
+        first_ = (first_ + 1) % windows_.size();
+        in_flight_--;
+    }
+
+    if (in_flight_ == 0 || windows_[first_].offset != offset) {
+        discard();
+        next_read_offset_ = offset;
+    }
+
+    // Keep every window but the one being decoded busy reading ahead
+    while (in_flight_ < windows_.size() && next_read_offset_ < file_size_) submitNext();
+    ring_->submit();
+
+    Window &window = windows_[first_];
+    waitFor(window);
+    if (window.result < 0) {
+        throw std::runtime_error(std::string("io_uring read failed: ") + strerror(-window.result));
+    }
+    if (window.result == 0) return false;
+
+    setWindow(window.offset, window.buffer.data(), window.result);
+
+    // A short read moves the following windows, they are read again on the next fetch
+    if ((size_t) window.result < window_size_) next_read_offset_ = window.offset + window.result;
+    return true;
+}
+
+#endif
+
+SiemensDatStream::SiemensDatStream(std::unique_ptr<std::streambuf> buf)
+    : std::istream(buf.get()), buf_(std::move(buf)), backend_(IoBackend::STREAM), streaming_(false),
+      following_(false), compression_(Compression::NONE) {
+}
+
+std::unique_ptr<SiemensDatStream> followSiemensDat(const std::string &filename, unsigned int idle_timeout,
+                                                   bool drop_cache) {
+#ifndef _WIN32
+    std::unique_ptr<FollowFileBuf> buf(new FollowFileBuf(filename, idle_timeout));
+    if (drop_cache) buf->dropCacheBehind(filename);
+    std::unique_ptr<SiemensDatStream> stream(new SiemensDatStream(std::move(buf)));
+    stream->following_ = true;
+    return stream;
+#else
+    throw std::runtime_error("Following a growing file is not supported on this platform");
+#endif
+}
+
+std::unique_ptr<SiemensDatStream> openSiemensDat(const std::string &filename, IoBackend backend,
+                                                 bool drop_cache) {
+#ifndef _WIN32
+    // Nothing to drop from the page cache for a pipe
+    if (filename == "-") {
+        std::unique_ptr<PipeInputBuf> buf(new PipeInputBuf(STDIN_FILENO));
+        std::unique_ptr<SiemensDatStream> stream(new SiemensDatStream(std::move(buf)));
+        stream->streaming_ = true;
+        return stream;
+    }
+
+    // Compressed files can only be read front to back, whichever backend was asked for
+    Compression compression = detectCompression(filename);
+    if (compression != Compression::NONE) {
+        unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+        std::unique_ptr<CompressedInputBuf> buf(new CompressedInputBuf(filename, compression, threads));
+        std::unique_ptr<SiemensDatStream> stream(new SiemensDatStream(std::move(buf)));
+        stream->streaming_ = true;
+        stream->compression_ = compression;
+        return stream;
+    }
+#endif
+
+    if (backend == IoBackend::MMAP) {
+        try {
+            std::unique_ptr<MappedFileBuf> buf(new MappedFileBuf(filename));
+            if (drop_cache) buf->dropCacheBehind(filename);
+            std::unique_ptr<SiemensDatStream> stream(new SiemensDatStream(std::move(buf)));
+            stream->backend_ = IoBackend::MMAP;
+            return stream;
+        }
+        catch (const std::exception &e) {
+            std::cerr << "WARNING: Could not memory map " << filename << " (" << e.what()
+                      << "), falling back to stream I/O." << std::endl;
+        }
+    }
+
+#ifndef _WIN32
+    if (backend == IoBackend::DIRECT) {
+        try {
+            std::unique_ptr<DirectFileBuf> buf(new DirectFileBuf(filename));
+            if (drop_cache) buf->dropCacheBehind(filename);
+            std::unique_ptr<SiemensDatStream> stream(new SiemensDatStream(std::move(buf)));
+            stream->backend_ = IoBackend::DIRECT;
+            return stream;
+        }
+        catch (const std::exception &e) {
+            std::cerr << "WARNING: Could not use direct I/O for " << filename << " (" << e.what()
+                      << "), falling back to stream I/O." << std::endl;
+        }
+    }
+
+    if (backend == IoBackend::URING) {
+        try {
+            std::unique_ptr<ReadaheadFileBuf> buf(new ReadaheadFileBuf(filename));
+            if (drop_cache) buf->dropCacheBehind(filename);
+            std::unique_ptr<SiemensDatStream> stream(new SiemensDatStream(std::move(buf)));
+            stream->backend_ = IoBackend::URING;
+            return stream;
+        }
+        catch (const std::exception &e) {
+            std::cerr << "WARNING: Could not use io_uring for " << filename << " (" << e.what()
+                      << "), falling back to stream I/O." << std::endl;
+        }
+    }
+
+    // std::filebuf does not expose its descriptor for the hints
+    if (drop_cache) {
+        std::unique_ptr<SequentialFileBuf> buf(new SequentialFileBuf(filename));
+        buf->dropCacheBehind(filename);
+        return std::unique_ptr<SiemensDatStream>(new SiemensDatStream(std::move(buf)));
+    }
+#endif
+
+    std::unique_ptr<std::filebuf> buf(new std::filebuf);
+    if (!buf->open(filename.c_str(), std::ios::in | std::ios::binary)) {
+        throw std::runtime_error("Failed to open " + filename);
+    }
+    return std::unique_ptr<SiemensDatStream>(new SiemensDatStream(std::move(buf)));
+}
+
+PositionalDatFile::PositionalDatFile(const std::string &filename, IoBackend backend, bool drop_cache) {
+#ifndef _WIN32
+    fd_ = -1;
+#endif
+    if (backend == IoBackend::MMAP) {
+        try {
+            mapping_.open(filename);
+            if (drop_cache) dropper_.open(filename, mapping_.data(), mapping_.size());
+            return;
+        }
+        catch (const std::exception &e) {
+            std::cerr << "WARNING: Could not memory map " << filename << " (" << e.what()
+                      << "), falling back to stream I/O." << std::endl;
+        }
+    }
+
+#ifdef _WIN32
+    if (!file_.open(filename.c_str(), std::ios::in | std::ios::binary)) {
+        throw std::runtime_error("Failed to open " + filename);
+    }
+#else
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open " + filename + ": " + strerror(errno));
+    }
+#endif
+    if (drop_cache) dropper_.open(filename);
+}
+
+PositionalDatFile::~PositionalDatFile() {
+#ifndef _WIN32
+    if (fd_ >= 0) ::close(fd_);
+#endif
+}
+
+const char *PositionalDatFile::read(uint64_t offset, size_t n, std::vector<char> &buffer) const {
+    if (mapping_.is_open()) {
+        if (offset > mapping_.size() || n > mapping_.size() - offset) {
+            throw std::runtime_error("Read past the end of the file");
+        }
+        return mapping_.data() + offset;
+    }
+
+    if (buffer.size() < n) buffer.resize(n);
+
+#ifdef _WIN32
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_.pubseekpos(offset, std::ios::in) != std::streampos(offset) ||
+        file_.sgetn(buffer.data(), n) != (std::streamsize) n) {
+        throw std::runtime_error("Read past the end of the file");
+    }
+#else
+    size_t done = 0;
+    while (done < n) {
+        ssize_t got = ::pread(fd_, buffer.data() + done, n - done, offset + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) throw std::runtime_error(std::string("Failed to read the file: ") + strerror(errno));
+        if (got == 0) throw std::runtime_error("Read past the end of the file");
+        done += got;
+    }
+#endif
+    return buffer.data();
+}
+
+namespace {
+
+void dropFromPageCache(const std::string &filename) {
+#ifdef POSIX_FADV_DONTNEED
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#endif
+}
+
+}
+
+void benchmarkIoBackends(const std::string &filename, std::ostream &out) {
+    const IoBackend backends[] = {IoBackend::STREAM, IoBackend::MMAP, IoBackend::URING, IoBackend::DIRECT};
+    const std::streamsize block_size = 1 << 20;
+
+    std::vector<char> buffer;
+    for (IoBackend backend : backends) {
+        dropFromPageCache(filename);
+
+        auto start = std::chrono::steady_clock::now();
+        auto stream = openSiemensDat(filename, backend);
+        if (stream->backend() != backend) {
+            out << ioBackendName(backend) << ": not available" << std::endl;
+            continue;
+        }
+
+        stream->seekg(0, std::ios::end);
+        std::streamoff remaining = stream->tellg();
+        stream->seekg(0, std::ios::beg);
+        const std::streamoff total = remaining;
+
+        // Touch every page like the decoder would, so lazily mapped pages are really read
+        unsigned long checksum = 0;
+        while (remaining > 0 && *stream) {
+            std::streamsize n = std::min<std::streamoff>(block_size, remaining);
+            const char *block = readBlock(*stream, n, buffer);
+            for (std::streamsize i = 0; i < n; i += 4096) checksum += (unsigned char) block[i];
+            remaining -= n;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!*stream) {
+            out << ioBackendName(backend) << ": read error" << std::endl;
+            continue;
+        }
+        out << ioBackendName(backend) << ": " << total / 1048576.0 / elapsed.count() << " MB/s ("
+            << elapsed.count() << " s, checksum " << checksum << ")" << std::endl;
+    }
+}
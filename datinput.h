@@ -0,0 +1,333 @@
+#ifndef DATINPUT_H_
+#define DATINPUT_H_
+
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "iouring.h"
+
+/// Input backends for reading the Siemens dat file
+enum class IoBackend {
+    STREAM, // buffered std::filebuf reads (default)
+    MMAP,   // memory mapped file, headers and samples are copied straight out of the mapping
+    URING,  // io_uring reads kept in flight ahead of the decoder
+    DIRECT  // large aligned O_DIRECT reads, bypassing the page cache
+};
+
+/// Compression of the dat file, see compressedinput.h
+enum class Compression : int;
+
+IoBackend parseIoBackend(const std::string &name);
+
+std::string ioBackendName(IoBackend backend);
+
+/// Evicts the part of a file before the read cursor from the page cache, so converting a huge file
+/// does not push everything else out of memory. Pages are dropped in large steps to keep the
+/// number of system calls low. Does nothing until open is called.
+class PageCacheDropper {
+public:
+    PageCacheDropper();
+    ~PageCacheDropper();
+
+    PageCacheDropper(const PageCacheDropper &) = delete;
+    PageCacheDropper &operator=(const PageCacheDropper &) = delete;
+
+    /// Opens a descriptor of its own. If the file is memory mapped, the mapped pages are released as well.
+    void open(const std::string &filename, const char *mapping = nullptr, uint64_t mapping_size = 0);
+
+    /// Everything before offset has been consumed
+    void dropBefore(uint64_t offset);
+
+private:
+    int fd_;
+    const char *mapping_;
+    uint64_t mapping_size_;
+    uint64_t dropped_; // Everything before this offset has been dropped already
+};
+
+/// Base class of the converter's own streambufs. Allows the scan decoder to work on
+/// bytes that are already buffered without copying them out first.
+class DatInputBuf : public std::streambuf {
+public:
+    /// Consumes the next n bytes and returns a pointer to them if they are contiguous
+    /// in the get area, returns nullptr (and consumes nothing) otherwise.
+    virtual const char *view(std::streamsize n);
+
+    /// Whether viewed bytes stay valid after further reads
+    virtual bool persistentViews() const { return false; }
+
+    /// Advises the kernel that filename is read front to back and enables dropCacheBefore
+    virtual void dropCacheBehind(const std::string &filename) { dropper_.open(filename); }
+
+    /// Evicts the file data before offset from the page cache, once dropCacheBehind has been called
+    void dropCacheBefore(uint64_t offset) { dropper_.dropBefore(offset); }
+
+protected:
+    PageCacheDropper dropper_;
+};
+
+/// Read-only streambuf whose get area spans the whole memory mapped file.
+/// Reads are plain memcpy's from the mapping and seeks only move the get pointer.
+class MappedFileBuf : public DatInputBuf {
+public:
+    explicit MappedFileBuf(const std::string &filename);
+
+    bool is_open() const { return mapping_.is_open(); }
+
+    bool persistentViews() const override { return true; }
+
+    void dropCacheBehind(const std::string &filename) override;
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+    std::streamsize showmanyc() override;
+    std::streamsize xsgetn(char_type *s, std::streamsize n) override;
+
+    boost::iostreams::mapped_file_source mapping_;
+};
+
+/// Streambuf over a file descriptor that reads the file in large windows. Subclasses decide how
+/// a window gets filled, seeks within the current window only move the get pointer.
+class WindowedFileBuf : public DatInputBuf {
+public:
+    ~WindowedFileBuf() override;
+
+    void dropCacheBehind(const std::string &filename) override;
+
+protected:
+    /// Takes ownership of fd
+    explicit WindowedFileBuf(int fd);
+
+    /// Makes the data at offset the get area using setWindow. Returns false at the end of the file.
+    virtual bool fetchWindow(uint64_t offset) = 0;
+
+    /// Called when a seek leaves the current window, before the window at the new position is fetched
+    virtual void discard() {}
+
+    /// Forward-only inputs refuse seeks to before the current window
+    virtual bool seekable() const { return true; }
+
+    /// Seeks relative to the end fail for inputs whose final size is not known yet
+    virtual bool sizeKnown() const { return true; }
+
+    /// begin holds the file data from offset on, reading continues at begin + position
+    void setWindow(uint64_t offset, char *begin, size_t length, size_t position = 0);
+
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+    std::streamsize xsgetn(char_type *s, std::streamsize n) override;
+
+    int fd_;
+    uint64_t window_offset_; // File offset of eback()
+};
+
+/// Reads the file with plain read calls into a single window. Used instead of std::filebuf where
+/// the converter needs the file descriptor.
+class SequentialFileBuf : public WindowedFileBuf {
+public:
+    explicit SequentialFileBuf(const std::string &filename, size_t window_size = 1 << 20);
+
+protected:
+    bool fetchWindow(uint64_t offset) override;
+
+private:
+    std::vector<char> buffer_;
+};
+
+/// Keeps several large reads in flight ahead of the get pointer using io_uring.
+/// The constructor throws if io_uring is not available.
+class ReadaheadFileBuf : public WindowedFileBuf {
+public:
+    ReadaheadFileBuf(const std::string &filename, size_t window_size = 4 << 20, unsigned int depth = 4);
+    ~ReadaheadFileBuf() override;
+
+protected:
+    bool fetchWindow(uint64_t offset) override;
+    void discard() override;
+
+private:
+    struct Window;
+
+    void submitNext();
+    void waitFor(Window &window);
+
+    std::unique_ptr<IoUring> ring_;
+    std::vector<Window> windows_;
+    size_t window_size_;
+    unsigned int first_;         // Window holding the get area, the following ones are in flight
+    unsigned int in_flight_;
+    uint64_t next_read_offset_;  // Offset of the next window to submit
+    uint64_t file_size_;
+};
+
+/// Aligned buffers for direct I/O, kept for reuse once released so that
+/// the streams opened for every measurement do not allocate their windows again
+class AlignedBufferPool {
+public:
+    static const size_t ALIGNMENT = 4096;
+
+    /// Returns a buffer of at least size bytes, aligned to ALIGNMENT
+    static std::shared_ptr<char> acquire(size_t size);
+
+private:
+    struct FreeBuffer {
+        size_t size;
+        char *data;
+    };
+
+    static void release(char *data, size_t size);
+
+    static std::mutex mutex_;
+    static std::vector<FreeBuffer> free_;
+};
+
+/// Reads the file with O_DIRECT into large aligned windows, so the data never enters the page cache.
+/// Every window starts at an aligned offset, the get pointer is placed at the requested position
+/// inside it. Throws from the constructor if the file can not be opened for direct I/O, and falls
+/// back to buffered reads if the file system rejects the first direct read.
+class DirectFileBuf : public WindowedFileBuf {
+public:
+    explicit DirectFileBuf(const std::string &filename, size_t window_size = 8 << 20);
+
+protected:
+    bool fetchWindow(uint64_t offset) override;
+
+private:
+    std::shared_ptr<char> buffer_;
+    size_t window_size_;
+};
+
+/// Forward-only input from a pipe or stdin. Forward seeks read and drop the data in between,
+/// the last history bytes before the current window stay available for short backward seeks.
+class PipeInputBuf : public WindowedFileBuf {
+public:
+    explicit PipeInputBuf(int fd, size_t window_size = 4 << 20, size_t history = 64 << 10);
+
+protected:
+    bool fetchWindow(uint64_t offset) override;
+    bool seekable() const override { return false; }
+
+    /// Reads up to n bytes, blocking until at least one is available. Returns 0 at the end of the input.
+    virtual size_t readSome(char *buffer, size_t n);
+
+private:
+    std::vector<char> buffer_;
+    size_t window_size_;
+    size_t history_;
+    uint64_t consumed_; // Bytes read from the pipe so far
+    size_t buffered_;   // Bytes at the start of buffer_ holding the data right before consumed_
+};
+
+/// Reads a file that is still being written. Reading past the current end of the file waits
+/// until the file grows (using inotify where available, polling otherwise) and only reports the
+/// end of the file once it has not grown for idle_timeout seconds.
+class FollowFileBuf : public WindowedFileBuf {
+public:
+    FollowFileBuf(const std::string &filename, unsigned int idle_timeout, size_t window_size = 4 << 20);
+    ~FollowFileBuf() override;
+
+protected:
+    bool fetchWindow(uint64_t offset) override;
+    bool sizeKnown() const override { return false; }
+
+private:
+    /// Returns false if the file is still not larger than size after the idle timeout
+    bool waitForGrowth(uint64_t size);
+
+    std::vector<char> buffer_;
+    size_t window_size_;
+    unsigned int idle_timeout_;
+    int inotify_fd_;
+};
+
+/// std::istream owning the streambuf of the selected backend
+class SiemensDatStream : public std::istream {
+public:
+    explicit SiemensDatStream(std::unique_ptr<std::streambuf> buf);
+
+    IoBackend backend() const { return backend_; }
+
+    /// Reading from stdin, only forward seeks are possible
+    bool streaming() const { return streaming_; }
+
+    /// Following a file that is still growing, its size is not known
+    bool following() const { return following_; }
+
+    /// Compression of the file, compressed files are read like stdin
+    Compression compression() const { return compression_; }
+
+private:
+    friend std::unique_ptr<SiemensDatStream> openSiemensDat(const std::string &filename, IoBackend backend,
+                                                            bool drop_cache);
+    friend std::unique_ptr<SiemensDatStream> followSiemensDat(const std::string &filename, unsigned int idle_timeout,
+                                                              bool drop_cache);
+
+    std::unique_ptr<std::streambuf> buf_;
+    IoBackend backend_;
+    bool streaming_;
+    bool following_;
+    Compression compression_;
+};
+
+/// Reads the next n bytes as one block. The returned pointer either points into the
+/// stream's own buffer (zero copy) or into buffer, which is grown as needed and can be
+/// reused between calls. Unless persistent is set the pointer is only valid until the next
+/// read from the stream. Check the stream state for errors.
+const char *readBlock(std::istream &is, std::streamsize n, std::vector<char> &buffer, bool persistent = false);
+
+/// Opens the dat file with the requested backend, falling back to the stream backend
+/// if the file can not be memory mapped. "-" reads from stdin, gzip and zstd compressed
+/// files are decompressed on the fly.
+/// With drop_cache the stream's DatInputBuf is set up for DatInputBuf::dropCacheBefore.
+std::unique_ptr<SiemensDatStream> openSiemensDat(const std::string &filename, IoBackend backend,
+                                                 bool drop_cache = false);
+
+/// Opens a dat file that is still being written, see FollowFileBuf. Throws if the file can not be opened.
+std::unique_ptr<SiemensDatStream> followSiemensDat(const std::string &filename, unsigned int idle_timeout,
+                                                   bool drop_cache = false);
+
+/// Reads the whole file through each available backend and prints the throughput.
+/// The file's pages are dropped from the page cache before every run where the system allows it.
+void benchmarkIoBackends(const std::string &filename, std::ostream &out);
+
+/// Positional reads from the dat file, safe to use from several threads at once.
+/// Used to decode scans out of order once their offsets are known.
+class PositionalDatFile {
+public:
+    /// Maps the file with the mmap backend (falling back to plain reads if it can not be mapped).
+    /// With drop_cache, dropCacheBefore evicts the consumed part of the file from the page cache.
+    PositionalDatFile(const std::string &filename, IoBackend backend, bool drop_cache = false);
+    ~PositionalDatFile();
+
+    PositionalDatFile(const PositionalDatFile &) = delete;
+    PositionalDatFile &operator=(const PositionalDatFile &) = delete;
+
+    /// Returns n bytes at offset, pointing either into the mapping or into buffer.
+    /// Throws if the file ends before offset + n.
+    const char *read(uint64_t offset, size_t n, std::vector<char> &buffer) const;
+
+    /// No reads before offset will follow. Not thread safe, call it from a single thread.
+    void dropCacheBefore(uint64_t offset) { dropper_.dropBefore(offset); }
+
+private:
+    boost::iostreams::mapped_file_source mapping_;
+    PageCacheDropper dropper_;
+#ifdef _WIN32
+    mutable std::mutex mutex_;
+    mutable std::filebuf file_;
+#else
+    int fd_;
+#endif
+};
+
+#endif //DATINPUT_H_
@@ -0,0 +1,178 @@
+#include "iouring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+int io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+}
+
+IoUring::IoUring(unsigned int entries)
+    : ring_fd_(-1), to_submit_(0), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED), sq_ring_size_(0), cq_ring_size_(0),
+      sqes_(MAP_FAILED), sqes_size_(0) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd_ = io_uring_setup(entries, &params);
+    if (ring_fd_ < 0) {
+        throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                    IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        close(ring_fd_);
+        throw std::runtime_error("Failed to map the io_uring submission ring");
+    }
+
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                        IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            munmap(sq_ring_, sq_ring_size_);
+            close(ring_fd_);
+            throw std::runtime_error("Failed to map the io_uring completion ring");
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        if (!single_mmap) munmap(cq_ring_, cq_ring_size_);
+        munmap(sq_ring_, sq_ring_size_);
+        close(ring_fd_);
+        throw std::runtime_error("Failed to map the io_uring submission entries");
+    }
+
+    char *sq = static_cast<char *>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+}
+
+IoUring::~IoUring() {
+    munmap(sqes_, sqes_size_);
+    if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    munmap(sq_ring_, sq_ring_size_);
+    close(ring_fd_);
+}
+
+bool IoUring::queueRead(int fd, const struct iovec *iov, uint64_t offset, uint64_t user_data) {
+    unsigned int tail = *sq_tail_;
+    unsigned int head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (tail - head > *sq_mask_) return false;
+
+    unsigned int index = tail & *sq_mask_;
+    struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes_) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    // IORING_OP_READV is the oldest read operation, available since the first io_uring kernels
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(iov);
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+    return true;
+}
+
+void IoUring::submit() {
+    while (to_submit_ > 0) {
+        int ret = io_uring_enter(ring_fd_, to_submit_, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+        }
+        to_submit_ -= ret;
+    }
+}
+
+void IoUring::waitCompletion(uint64_t &user_data, int &res) {
+    for (;;) {
+        unsigned int head = *cq_head_;
+        if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = static_cast<struct io_uring_cqe *>(cqes_) + (head & *cq_mask_);
+            user_data = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+            return;
+        }
+
+        int ret = io_uring_enter(ring_fd_, to_submit_, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+        }
+        to_submit_ -= ret;
+    }
+}
+
+bool IoUring::compiledIn() {
+    return true;
+}
+
+#else
+
+IoUring::IoUring(unsigned int) {
+    throw std::runtime_error("io_uring support was not compiled in");
+}
+
+IoUring::~IoUring() {
+}
+
+bool IoUring::queueRead(int, const struct iovec *, uint64_t, uint64_t) {
+    return false;
+}
+
+void IoUring::submit() {
+}
+
+void IoUring::waitCompletion(uint64_t &, int &) {
+    throw std::runtime_error("io_uring support was not compiled in");
+}
+
+bool IoUring::compiledIn() {
+    return false;
+}
+
+#endif
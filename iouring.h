@@ -0,0 +1,52 @@
+#ifndef IOURING_H_
+#define IOURING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+struct iovec;
+
+/// Minimal io_uring submission/completion ring for file reads, using the raw system calls.
+/// The constructor throws if io_uring is not available (old kernel, seccomp, non-Linux build).
+class IoUring {
+public:
+    explicit IoUring(unsigned int entries);
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    /// Queues a read into iov, submitted with the next submit() call. Returns false if the queue is full.
+    bool queueRead(int fd, const struct iovec *iov, uint64_t offset, uint64_t user_data);
+
+    /// Submits all queued reads
+    void submit();
+
+    /// Waits for the next completion, res is the number of bytes read or -errno
+    void waitCompletion(uint64_t &user_data, int &res);
+
+    /// Whether this build has io_uring support at all
+    static bool compiledIn();
+
+private:
+    int ring_fd_;
+    unsigned int to_submit_;
+
+    void *sq_ring_;
+    void *cq_ring_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    void *sqes_;
+    size_t sqes_size_;
+
+    unsigned int *sq_head_;
+    unsigned int *sq_tail_;
+    unsigned int *sq_mask_;
+    unsigned int *sq_array_;
+    unsigned int *cq_head_;
+    unsigned int *cq_tail_;
+    unsigned int *cq_mask_;
+    void *cqes_;
+};
+
+#endif //IOURING_H_
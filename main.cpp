@@ -16,6 +16,15 @@
 #include "base64.h"
 #include "XNode.h"
 #include "ConverterXml.h"
+#include "datinput.h"
+#include "compressedinput.h"
+#include "pipeline.h"
+#include "mrdoutput.h"
+#include "mrdstream.h"
+#include "scanindex.h"
+#include "scandecoder.h"
+#include "measurementlog.h"
+#include "alloccounter.h"
 
 #include "ismrmrd/ismrmrd.h"
 #include "ismrmrd/dataset.h"
@@ -30,7 +39,12 @@ namespace po = boost::program_options;
 #include <boost/locale/encoding_utf.hpp>
 using boost::locale::conv::utf_to_utf;
 
+#include <algorithm>
+#include <atomic>
 #include <iomanip>
+#include <limits>
+#include <mutex>
+#include <thread>
 
 #include <iostream>
 #include <string>
@@ -41,24 +55,98 @@ using boost::locale::conv::utf_to_utf;
 #include <typeinfo>
 
 const size_t MYSTERY_BYTES_EXPECTED = 160;
+// Length of a VB measurement read from stdin, the file size is not known up front
+const uint64_t UNKNOWN_MEASUREMENT_LENGTH = std::numeric_limits<int64_t>::max();
+
+// libxml2 and libxslt keep global state (parseXML even tears it down when done),
+// so measurements converted in parallel take turns using them
+std::mutex libxml_mutex;
 
 // defined in generated defaults.cpp
 extern void initializeEmbeddedFiles(void);
 extern std::map<std::string, std::string> global_embedded_files;
 
 
-struct ChannelHeaderAndData
-{
-    sChannelHeader header;
-    std::vector<complex_float_t> data;
-};
-
 struct MeasurementHeaderBuffer
 {
     std::string name;
     std::string buf;
 };
 
+/// A scan on its way from the dat file to the ISMRMRD dataset
+struct ScanWork
+{
+    enum Kind {
+        ACQUISITION,
+        SYNCDATA,
+        LAST_SCAN, // Finalizes the header but is not written (ACQEND, or the scan data could not be read)
+        SKIPPED    // Not selected for conversion, only used for the header
+    };
+
+    Kind kind;
+    uint64_t offset;        // File offset of the scan header
+    sScanHeader scanhead;
+    long last_scan_counter; // Scan counter the sync data belongs to
+    const char *block;      // Data following the scan header, points into buffer or the input's memory mapping
+    size_t block_length;
+    std::vector<char> buffer;
+    ISMRMRD::Acquisition *acquisition;        // Points into acquisitions
+    AcquisitionPool acquisitions;
+    std::vector<ISMRMRD::Waveform> waveforms; // Reused from packet to packet, only the first waveform_count are valid
+    size_t waveform_count;
+    uint64_t allocations;                     // Heap allocations made while reading and converting the scan
+};
+
+// Number of scans in flight per conversion thread
+const size_t PIPELINE_DEPTH_PER_THREAD = 8;
+// Scans after which --allocStats considers the conversion loop to be in steady state
+const uint64_t ALLOCATION_WARMUP_SCANS = 1000;
+
+/// Command line settings and file layout shared by all measurements of a conversion
+struct ConversionSettings
+{
+    std::string siemens_dat_filename;
+    IoBackend io_backend;
+    std::string ismrmrd_file;  // Output file, suffixed with the measurement number with --allMeas
+    std::string ismrmrd_group; // Output group, suffixed with the measurement number with --multiMeasFile
+    std::string parammap_file;
+    std::string parammap_xsl;
+    std::string schema_file_name_content;
+    std::string study_date_user_supplied;
+
+    bool debug_xml;
+    bool flash_pat_ref_scan;
+    bool header_only;
+    bool append_buffers;
+    bool all_measurements;
+    bool multi_meas_file;
+    bool skip_syncdata;
+    bool attachTrajectory;
+    bool prescan;
+    bool streaming_input; // Reading from stdin or a compressed file, the input can only be read front to back
+    bool follow_input;    // The dat file is still being written, its size is not known
+    bool drop_cache;      // Drop the converted input and the written output from the page cache
+    bool alloc_stats;     // Report the heap allocations of the conversion loop
+    bool presize;         // Size the output for the whole measurement from a walk over the scan headers
+    size_t batch_records; // Acquisitions and waveforms buffered per HDF5 write
+    size_t batch_bytes;   // ... or as soon as their samples reach this size
+    bool swmr;            // Write the output in HDF5 single writer / multiple reader mode
+    unsigned int swmr_flush_ms;
+    uint64_t memory_limit; // Build outputs of measurements up to this size in memory, 0 writes to disk
+    bool stream;           // Write ISMRMRD streaming protocol messages instead of an HDF5 file
+    std::string stream_config; // Reconstruction selected by a config message at the start of the stream
+    std::string server_address; // Stream to this ISMRMRD protocol server (host:port) instead of writing a file
+    std::string reply_file;     // Where the replies of the server are saved
+    std::shared_ptr<ShmRingWriter> shm_ring; // Publish the measurements into this shared memory ring instead
+
+    bool VBFILE;
+    MrParcRaidFileHeader ParcRaidHead;
+    std::vector<MrParcRaidFileEntry> ParcFileEntries;
+    std::shared_ptr<const DatFileIndex> scan_index; // Sidecar scan index, if there is a valid one
+    std::vector<ScanQuery> fetch;                   // Only convert these scans (random access)
+    LoopCounterFilter filter;                       // Skip scans outside of these loop counter ranges
+};
+
 void calc_vds(double slewmax,double gradmax,double Tgsample,double Tdsample,int Ninterleaves,
               double* fov, int numfov,double krmax,
               int ngmax, double** xgrad,double** ygrad,int* numgrad);
@@ -69,18 +157,25 @@ void calc_traj(double* xgrad, double* ygrad, int ngrad, int Nints, double Tgsamp
                double** weights);
 
 
-std::vector<ISMRMRD::Waveform> readSyncdata(std::ifstream &siemens_dat, bool VBFILE, unsigned long acquisitions,
-                                            uint32_t dma_length, sScanHeader scanheader, ISMRMRD::IsmrmrdHeader &header,
-                                            long scan_counter, bool skip_syncdata);
+const char *readSyncdata(std::istream &siemens_dat, bool VBFILE, uint32_t dma_length, bool skip_syncdata,
+                         std::vector<char> &scan_buffer, size_t &len, bool persistent);
+
+size_t decodeSyncdata(const char *block, size_t len, const sScanHeader &scanheader, long last_scan_counter,
+                      std::vector<ISMRMRD::Waveform> &waveforms);
+
+void makeWaveformHeader(ISMRMRD::IsmrmrdHeader &header);
 
 std::string select_file(const std::string &, const std::string &, bool, unsigned int);
 std::string get_file_content(const std::string &file);
 
 
 std::vector<MrParcRaidFileEntry>
-readParcFileEntries(std::ifstream &siemens_dat, const MrParcRaidFileHeader &ParcRaidHead, bool VBFILE);
+readParcFileEntries(std::istream &siemens_dat, const MrParcRaidFileHeader &ParcRaidHead, bool VBFILE);
 
-std::vector<MeasurementHeaderBuffer> readMeasurementHeaderBuffers(std::ifstream &siemens_dat, uint32_t num_buffers);
+int convertMeasurement(const ConversionSettings &settings, std::istream &siemens_dat, unsigned int currentMeas,
+                       unsigned int num_threads);
+
+std::vector<MeasurementHeaderBuffer> readMeasurementHeaderBuffers(std::istream &siemens_dat, uint32_t num_buffers);
 
 std::string readXmlConfig(bool debug_xml, const std::string &parammap_file_content, uint32_t num_buffers,
                           std::vector<MeasurementHeaderBuffer> &buffers, std::vector<std::string> &wip_double,
@@ -95,16 +190,6 @@ getTrajectory(const std::vector<std::string> &wip_double, const Trajectory &traj
               long radial_views);
 
 
-ISMRMRD::Acquisition
-getAcquisition(bool flash_pat_ref_scan, const Trajectory &trajectory, long dwell_time_0, long* global_table_pos, long max_channels,
-               bool isAdjustCoilSens, bool isAdjQuietCoilSens, bool isVB, bool isNX, bool attachTrajectory, ISMRMRD::NDArray<float> &traj,
-               const sScanHeader &scanhead, const std::vector<ChannelHeaderAndData> &channels);
-
-void readScanHeader(std::ifstream &siemens_dat, bool VBFILE, sMDH &mdh, sScanHeader &scanhead);
-
-std::vector<ChannelHeaderAndData>
-readChannelHeaders(std::ifstream &siemens_dat, bool VBFILE, const sScanHeader &scanhead);
-
 int xml_file_is_valid(std::string &xml, std::string &schema_file) {
     xmlDocPtr doc;
     //parse an XML in-memory block and build a tree.
@@ -357,33 +442,6 @@ std::string ProcessParameterMap(const XProtocol::XNode &node, const char *mapfil
 }
 
 
-/// compute noise dwell time in us for dependency and built-in noise in VD/VB lines
-double compute_noise_sample_in_us(size_t num_of_noise_samples_this_acq, bool isAdjustCoilSens, bool isAdjQuietCoilSens,
-                                  bool isVB, bool isNX)
-{
-    if(isNX)
-    {
-        return 5.0;
-    }
-    else if (isAdjustCoilSens)
-    {
-        return 5.0;
-    }
-    else if (isAdjQuietCoilSens)
-    {
-        return 4.0;
-    }
-    else if (isVB)
-    {
-        return (1e6 / num_of_noise_samples_this_acq / 130.0);
-    }
-    else
-    {
-        return (((long) (76800.0 / num_of_noise_samples_this_acq)) / 10.0);
-    }
-
-    return 5.0;
-}
 
 std::string load_embedded(std::string name) {
     std::string contents;
@@ -456,6 +514,31 @@ int main(int argc, char* argv[]) {
     bool attachTrajectory = false;
     bool list = false;
     std::string to_extract;
+    std::string io_backend_name;
+    bool io_benchmark = false;
+    unsigned int num_threads = 1;
+    bool prescan = false;
+    bool save_index = false;
+    bool follow = false;
+    bool drop_cache = false;
+    bool alloc_stats = false;
+    bool presize = false;
+    size_t batch_records = 256;
+    size_t batch_mb = 16;
+    bool swmr = false;
+    unsigned int swmr_flush_ms = 1000;
+    bool in_memory = false;
+    size_t in_memory_mb = 256;
+    bool stream = false;
+    std::string stream_config;
+    std::string server_address;
+    std::string reply_file;
+    std::string shm_name;
+    size_t shm_mb = 256;
+    unsigned int shm_timeout = 60;
+    unsigned int follow_timeout = 60;
+    std::vector<std::string> fetch_queries;
+    std::string slices, repetitions, contrasts, sets;
 
     std::string xslt_home;
 
@@ -463,17 +546,45 @@ int main(int argc, char* argv[]) {
     desc.add_options()
         ("help,h", "Produce HELP message")
         ("version,v", "Prints converter version and ISMRMRD version")
-        ("file,f", po::value<std::string>(&siemens_dat_filename), "<SIEMENS dat file>")
+        ("file,f", po::value<std::string>(&siemens_dat_filename), "<SIEMENS dat file (\"-\" reads from stdin)>")
         ("measNum,z", po::value<int>(&measurement_number)->default_value(1), "<Measurement number (with negative indexing)>")
         ("allMeas,Z", po::value<bool>(&all_measurements)->implicit_value(true), "<All measurements flag>")
         ("multiMeasFile,M", po::value<bool>(&multi_meas_file)->implicit_value(true), "<Multiple measurements in single output file flag>")
         ("skipSyncData", po::value<bool>(&skip_syncdata)->implicit_value(true), "<Skip syncdata (PMU) conversion>")
         ("attachTrajectory", po::value<bool>(&attachTrajectory)->implicit_value(true), "<Attach trajectories using vds design>")
+        ("io", po::value<std::string>(&io_backend_name)->default_value("stream"), "<Input I/O backend (stream, mmap, uring or direct)>")
+        ("ioBenchmark", po::value<bool>(&io_benchmark)->implicit_value(true), "<Compare the read throughput of the I/O backends on the input file and exit>")
+        ("threads", po::value<unsigned int>(&num_threads)->default_value(1), "<Number of conversion threads (> 1 overlaps reading, conversion and writing)>")
+        ("prescan", po::value<bool>(&prescan)->implicit_value(true), "<Index the scans first and read them on the conversion threads (with --threads)>")
+        ("saveIndex", po::value<bool>(&save_index)->implicit_value(true), "<Save a scan index next to the dat file, used by later runs>")
+        ("dropCache", po::value<bool>(&drop_cache)->implicit_value(true), "<Advise sequential reads and drop the converted input and the written output from the page cache>")
+        ("batchRecords", po::value<size_t>(&batch_records)->default_value(256), "<Acquisitions and waveforms written to HDF5 at once (1 writes every record on its own)>")
+        ("batchMB", po::value<size_t>(&batch_mb)->default_value(16), "<Write a batch as soon as its samples reach this many MiB>")
+        ("presize", po::value<bool>(&presize)->implicit_value(true), "<Count the acquisitions first and allocate the output for all of them at once>")
+        ("swmr", po::value<bool>(&swmr)->implicit_value(true), "<Write the output in HDF5 SWMR mode, readable while the conversion runs>")
+        ("swmrFlushMs", po::value<unsigned int>(&swmr_flush_ms)->default_value(1000), "<Milliseconds between the flushes that make new records visible to SWMR readers>")
+        ("inMemory", po::value<bool>(&in_memory)->implicit_value(true), "<Build small outputs in memory and write them with a single write at the end>")
+        ("inMemoryMB", po::value<size_t>(&in_memory_mb)->default_value(256), "<Outputs larger than this many MiB are written to disk as usual with --inMemory>")
+        ("stream", po::value<bool>(&stream)->implicit_value(true), "<Write the ISMRMRD streaming protocol (as read by Gadgetron) instead of an HDF5 file>")
+        ("streamConfig", po::value<std::string>(&stream_config), "<Start the stream with a config message naming this reconstruction configuration>")
+        ("connect", po::value<std::string>(&server_address), "<Stream to an ISMRMRD protocol server such as Gadgetron at host:port instead of writing a file>")
+        ("replyFile", po::value<std::string>(&reply_file), "<Save the messages the server sends back with --connect (images, ...) to this file>")
+        ("shm", po::value<std::string>(&shm_name), "<Publish the measurement into the POSIX shared memory ring of this name (e.g. /recon) for a reader on the same node>")
+        ("shmMB", po::value<size_t>(&shm_mb)->default_value(256), "<Size of the --shm ring in MiB>")
+        ("shmTimeout", po::value<unsigned int>(&shm_timeout)->default_value(60), "<Seconds to wait for a reader of the full --shm ring before giving up>")
+        ("allocStats", po::value<bool>(&alloc_stats)->implicit_value(true), "<Report the heap allocations of the conversion loop after the first 1000 scans>")
+        ("follow", po::value<bool>(&follow)->implicit_value(true), "<Convert a dat file that is still being written, waiting for it to grow>")
+        ("followTimeout", po::value<unsigned int>(&follow_timeout)->default_value(60), "<Seconds without growth after which --follow gives up>")
+        ("fetch", po::value<std::vector<std::string>>(&fetch_queries)->composing(), "<Only convert the scans matching a query like scan=1234 or line=64,partition=32 (repeatable)>")
+        ("slices", po::value<std::string>(&slices), "<Only convert these slices, e.g. 3-5 or 0,2>")
+        ("repetitions", po::value<std::string>(&repetitions), "<Only convert these repetitions, e.g. 0-9>")
+        ("contrasts", po::value<std::string>(&contrasts), "<Only convert these contrasts (echoes), e.g. 0>")
+        ("sets", po::value<std::string>(&sets), "<Only convert these sets, e.g. 0-1>")
         ("pMap,m", po::value<std::string>(&parammap_file), "<Parameter map XML file>")
         ("pMapStyle,x", po::value<std::string>(&parammap_xsl), "<Parameter stylesheet XSL file>")
         ("user-map", po::value<std::string>(&usermap_file), "<Provide a parameter map XML file>")
         ("user-stylesheet", po::value<std::string>(&usermap_xsl), "<Provide a parameter stylesheet XSL file>")
-        ("output,o", po::value<std::string>(), "<ISMRMRD output file (defaults to the input file name, with .mrd extension)>")
+        ("output,o", po::value<std::string>(), "<ISMRMRD output file (defaults to the input file name, with .mrd extension, \"-\" writes to stdout)>")
         ("outputGroup,g", po::value<std::string>(&ismrmrd_group)->default_value("dataset"),
             "<ISMRMRD output group>")
             ("list,l", po::value<bool>(&list)->implicit_value(true), "<List embedded files>")
@@ -491,15 +602,43 @@ int main(int argc, char* argv[]) {
     display_options.add_options()
         ("help,h", "Produce HELP message")
         ("version,v", "Prints converter version and ISMRMRD version")
-        ("file,f", "<SIEMENS dat file>")
+        ("file,f", "<SIEMENS dat file (\"-\" reads from stdin)>")
         ("measNum,z", "<Measurement number>")
         ("allMeas,Z", "<All measurements flag>")
         ("multiMeasFile,M", "<Multiple measurements in single file flag>")
         ("skipSyncData", "<Skip syncdata (PMU) conversion>")
         ("attachTrajectory", "<Attach trajectories using vds design>")
+        ("io", "<Input I/O backend (stream, mmap, uring or direct)>")
+        ("ioBenchmark", "<Compare the I/O backends on the input file>")
+        ("threads", "<Number of conversion threads>")
+        ("prescan", "<Index the scans first, read them in parallel>")
+        ("saveIndex", "<Save a scan index next to the dat file>")
+        ("dropCache", "<Drop converted input and written output from the page cache>")
+        ("batchRecords", "<Acquisitions and waveforms written to HDF5 at once>")
+        ("batchMB", "<Write a batch as soon as its samples reach this many MiB>")
+        ("presize", "<Count the acquisitions first and allocate the output at once>")
+        ("swmr", "<Write the output in HDF5 SWMR mode>")
+        ("swmrFlushMs", "<Milliseconds between flushes for SWMR readers>")
+        ("inMemory", "<Build small outputs in memory, write them at once>")
+        ("inMemoryMB", "<Size limit of --inMemory outputs in MiB>")
+        ("stream", "<Write the ISMRMRD streaming protocol instead of HDF5>")
+        ("streamConfig", "<Config message at the start of the stream>")
+        ("connect", "<Stream to an ISMRMRD protocol server at host:port>")
+        ("replyFile", "<Save the replies of the --connect server to this file>")
+        ("shm", "<Publish into the shared memory ring of this name>")
+        ("shmMB", "<Size of the --shm ring in MiB>")
+        ("shmTimeout", "<Seconds to wait for a reader of the full --shm ring>")
+        ("allocStats", "<Report the heap allocations of the conversion loop>")
+        ("follow", "<Convert a dat file that is still being written>")
+        ("followTimeout", "<Seconds without growth after which --follow gives up>")
+        ("fetch", "<Only convert the scans matching scan=N or line=L,partition=P,... (repeatable)>")
+        ("slices", "<Only convert these slices, e.g. 3-5>")
+        ("repetitions", "<Only convert these repetitions, e.g. 0-9>")
+        ("contrasts", "<Only convert these contrasts, e.g. 0>")
+        ("sets", "<Only convert these sets>")
         ("pMap,m", "<Parameter map XML>")
         ("pMapStyle,x", "<Parameter stylesheet XSL>")
-        ("output,o", "<ISMRMRD output file>")
+        ("output,o", "<ISMRMRD output file (\"-\" writes to stdout)>")
         ("outputGroup,g", "<ISMRMRD output group>")
         ("list,l", "<List embedded files>")
         ("extract,e", "<Extract embedded file>")
@@ -586,28 +725,162 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    // "-" streams the dat file from stdin
+    bool stdin_input = siemens_dat_filename == "-";
+
     // Check if Siemens file is valid
-    std::ifstream infile(siemens_dat_filename.c_str());
-    if (!infile) {
-        std::cerr << "Provided Siemens file can not be open or does not exist." << std::endl;
+    if (!stdin_input) {
+        std::ifstream infile(siemens_dat_filename.c_str());
+        if (!infile) {
+            std::cerr << "Provided Siemens file can not be open or does not exist." << std::endl;
+            std::cerr << display_options << "\n";
+            return -1;
+        }
+    }
+    std::cout << "Siemens file is: " << (stdin_input ? "<stdin>" : siemens_dat_filename) << std::endl;
+
+    // Compressed files are decompressed on the fly, like stdin they can only be read front to back
+    Compression compression = stdin_input ? Compression::NONE : detectCompression(siemens_dat_filename);
+    bool streaming_input = stdin_input || compression != Compression::NONE;
+
+    if (streaming_input && follow) {
+        std::cerr << "--follow can not be used " << (stdin_input ? "when reading from stdin" : "with compressed files")
+                  << std::endl;
+        std::cerr << display_options << "\n";
+        return -1;
+    }
+
+    if (swmr && multi_meas_file) {
+        // SWMR writing fixes the structure of the file, no further groups can be added to it
+        std::cerr << "--swmr can not be used with --multiMeasFile" << std::endl;
         std::cerr << display_options << "\n";
         return -1;
     }
-    std::cout << "Siemens file is: " << siemens_dat_filename << std::endl;
+
+    if (streaming_input || follow) {
+        // These need the complete file, read more than once or out of order
+        const char *needs_file = nullptr;
+        if (io_benchmark) needs_file = "--ioBenchmark";
+        else if (prescan) needs_file = "--prescan";
+        else if (save_index) needs_file = "--saveIndex";
+        else if (presize) needs_file = "--presize";
+        else if (!fetch_queries.empty()) needs_file = "--fetch";
+        if (needs_file) {
+            std::cerr << needs_file << " can not be used "
+                      << (follow ? "with --follow" : stdin_input ? "when reading from stdin" : "with compressed files")
+                      << std::endl;
+            std::cerr << display_options << "\n";
+            return -1;
+        }
+    }
 
     std::string ismrmrd_file;
-    if (!vm.count("output"))
+    if (!server_address.empty() || !shm_name.empty())
     {
+        // Nothing is written to a file, the server address or ring name stands in for it in messages
+        ismrmrd_file = server_address.empty() ? shm_name : server_address;
+    }
+    else if (!vm.count("output"))
+    {
+        if (stdin_input) {
+            std::cerr << "An output file (-o) is required when reading from stdin" << std::endl;
+            std::cerr << display_options << "\n";
+            return -1;
+        }
+
         boost::filesystem::path siemens_dat_path(siemens_dat_filename);
+        // meas.dat.gz becomes meas.mrd
+        if (compression != Compression::NONE) siemens_dat_path.replace_extension();
         ismrmrd_file = siemens_dat_path.replace_extension(".mrd").string();
         std::cout << "Output file not specified -- using " << ismrmrd_file << std::endl;
     } else {
         ismrmrd_file = vm["output"].as<std::string>();
     }
 
+    const char *stream_option = !server_address.empty() ? "--connect" : !shm_name.empty() ? "--shm"
+                                                                        : stream ? "--stream" : nullptr;
+    if (stream_option) {
+        // Streams carry the measurement written front to back, there are no HDF5 features
+        bool no_file = !server_address.empty() || !shm_name.empty();
+        const char *conflict = nullptr;
+        if (multi_meas_file) conflict = "--multiMeasFile";
+        else if (swmr) conflict = "--swmr";
+        else if (in_memory) conflict = "--inMemory";
+        else if (!server_address.empty() && !shm_name.empty()) conflict = "--shm";
+        else if (no_file && stream) conflict = "--stream";
+        else if (no_file && vm.count("output")) conflict = "--output";
+        else if (no_file && header_only) conflict = "--headerOnly";
+        if (conflict) {
+            std::cerr << stream_option << " can not be used with " << conflict << std::endl;
+            std::cerr << display_options << "\n";
+            return -1;
+        }
+    }
+    if (!reply_file.empty() && (server_address.empty() || all_measurements)) {
+        std::cerr << "--replyFile needs --connect and a single measurement" << std::endl;
+        std::cerr << display_options << "\n";
+        return -1;
+    }
+
+    if (ismrmrd_file == "-") {
+        // The file is built in memory (or streamed) and written to stdout, which can only take a single measurement
+        const char *conflict = nullptr;
+        if (all_measurements) conflict = "--allMeas";
+        else if (swmr) conflict = "--swmr";
+        else if (header_only) conflict = "--headerOnly";
+        if (conflict) {
+            std::cerr << "Writing to stdout can not be combined with " << conflict << std::endl;
+            std::cerr << display_options << "\n";
+            return -1;
+        }
+        // Keep the messages out of the file
+        std::cout.rdbuf(std::cerr.rdbuf());
+    } else if (in_memory && (swmr || multi_meas_file)) {
+        std::cerr << "--inMemory can not be used with " << (swmr ? "--swmr" : "--multiMeasFile") << std::endl;
+        std::cerr << display_options << "\n";
+        return -1;
+    }
+
+    IoBackend io_backend;
+    try {
+        io_backend = parseIoBackend(io_backend_name);
+    }
+    catch (const std::runtime_error &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        std::cerr << display_options << "\n";
+        return -1;
+    }
+
+    if (io_benchmark) {
+        benchmarkIoBackends(siemens_dat_filename, std::cout);
+        return 0;
+    }
+
     std::string schema_file_name_content = load_embedded("ismrmrd.xsd");
 
-    std::ifstream siemens_dat(siemens_dat_filename.c_str(), std::ios::binary);
+    std::unique_ptr<SiemensDatStream> siemens_dat_stream;
+    if (follow) {
+        try {
+            siemens_dat_stream = followSiemensDat(siemens_dat_filename, follow_timeout, drop_cache);
+        }
+        catch (const std::runtime_error &e) {
+            std::cerr << "ERROR: " << e.what() << std::endl;
+            return -1;
+        }
+    } else {
+        siemens_dat_stream = openSiemensDat(siemens_dat_filename, io_backend, drop_cache);
+    }
+    std::istream &siemens_dat = *siemens_dat_stream;
+    if (siemens_dat_stream->compression() != Compression::NONE) {
+        std::cout << "Input I/O backend: " << compressionName(siemens_dat_stream->compression())
+                  << " decompression (streaming)" << std::endl;
+    } else if (siemens_dat_stream->streaming()) {
+        std::cout << "Input I/O backend: stdin (streaming)" << std::endl;
+    } else if (siemens_dat_stream->following()) {
+        std::cout << "Input I/O backend: follow (waiting up to " << follow_timeout << " s for new data)" << std::endl;
+    } else {
+        std::cout << "Input I/O backend: " << ioBackendName(siemens_dat_stream->backend()) << std::endl;
+    }
 
     MrParcRaidFileHeader ParcRaidHead;
 
@@ -646,8 +919,6 @@ int main(int argc, char* argv[]) {
     }
 
     // Loop through all measurements in multi-raid
-    std::string ismrmrd_file_orig = ismrmrd_file;
-    std::string ismrmrd_group_orig = ismrmrd_group;
     unsigned int firstMeas, lastMeas;
 
     if (all_measurements)
@@ -661,642 +932,814 @@ int main(int argc, char* argv[]) {
         lastMeas  = measurement_number;
     }
 
-    for (unsigned int currentMeas = firstMeas; currentMeas <= lastMeas; currentMeas++) {
-        measurement_number = currentMeas;
-
-        if (all_measurements)
-        {
-            if (multi_meas_file)
-            {
-                // Add the measurement number as a suffix to the group name
-                ismrmrd_group = ismrmrd_group_orig;
-                ismrmrd_group.append("_");
-                ismrmrd_group.append(std::to_string(currentMeas));
-            }
-            else
-            {
-                // Add the measurement number as a suffix to the filename, excluding the file extension
-                std::vector<std::string> v;
-                boost::algorithm::split(v, ismrmrd_file_orig, boost::is_any_of("."));
+    ConversionSettings settings;
+    settings.siemens_dat_filename = siemens_dat_filename;
+    settings.io_backend = io_backend;
+    settings.ismrmrd_file = ismrmrd_file;
+    settings.ismrmrd_group = ismrmrd_group;
+    settings.parammap_file = parammap_file;
+    settings.parammap_xsl = parammap_xsl;
+    settings.schema_file_name_content = schema_file_name_content;
+    settings.study_date_user_supplied = study_date_user_supplied;
+    settings.debug_xml = debug_xml;
+    settings.flash_pat_ref_scan = flash_pat_ref_scan;
+    settings.header_only = header_only;
+    settings.append_buffers = append_buffers;
+    settings.all_measurements = all_measurements;
+    settings.multi_meas_file = multi_meas_file;
+    settings.skip_syncdata = skip_syncdata;
+    settings.attachTrajectory = attachTrajectory;
+    settings.prescan = prescan;
+    settings.streaming_input = streaming_input;
+    settings.follow_input = follow;
+    settings.drop_cache = drop_cache;
+    settings.alloc_stats = alloc_stats;
+    settings.presize = presize;
+    settings.swmr = swmr;
+    settings.swmr_flush_ms = swmr_flush_ms;
+    settings.memory_limit = in_memory ? (uint64_t) in_memory_mb << 20 : 0;
+    settings.stream = stream;
+    settings.stream_config = stream_config;
+    settings.server_address = server_address;
+    settings.reply_file = reply_file;
+    if (!shm_name.empty()) {
+        // One ring for all measurements, published one after the other
+        try {
+            settings.shm_ring.reset(new ShmRingWriter(shm_name, shm_mb << 20, shm_timeout));
+        }
+        catch (const std::exception &e) {
+            std::cerr << "ERROR: " << e.what() << std::endl;
+            return -1;
+        }
+        std::cout << "Publishing into shared memory ring " << shm_name << std::endl;
+    }
+    settings.batch_records = batch_records;
+    settings.batch_bytes = batch_mb << 20;
+    try {
+        for (const auto &query : fetch_queries) settings.fetch.push_back(parseScanQuery(query));
+        if (!slices.empty()) settings.filter.slices = parseRanges(slices);
+        if (!repetitions.empty()) settings.filter.repetitions = parseRanges(repetitions);
+        if (!contrasts.empty()) settings.filter.contrasts = parseRanges(contrasts);
+        if (!sets.empty()) settings.filter.sets = parseRanges(sets);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        std::cerr << display_options << "\n";
+        return -1;
+    }
+    settings.VBFILE = VBFILE;
+    settings.ParcRaidHead = ParcRaidHead;
+
+    // The measurement offsets are only parsed once, all measurements are converted from them
+    settings.ParcFileEntries = readParcFileEntries(siemens_dat, ParcRaidHead, VBFILE);
+
+    // A scan index saved by an earlier run saves walking the measurements again
+    if (!streaming_input && !follow) {
+        std::shared_ptr<DatFileIndex> scan_index(new DatFileIndex);
+        std::streampos position = siemens_dat.tellg();
+        if (loadScanIndex(siemens_dat_filename, *scan_index) && scan_index->VBFILE == VBFILE) {
+            std::cout << "Using scan index " << scanIndexFilename(siemens_dat_filename) << std::endl;
+            settings.scan_index = scan_index;
+        } else if (save_index) {
+            *scan_index = buildDatFileIndex(siemens_dat, siemens_dat_filename, VBFILE, settings.ParcFileEntries,
+                                            ParcRaidHead.count_);
+            saveScanIndex(siemens_dat_filename, *scan_index);
+            std::cout << "Saved scan index " << scanIndexFilename(siemens_dat_filename) << std::endl;
+            settings.scan_index = scan_index;
+        }
+        siemens_dat.seekg(position, std::ios::beg);
+    }
 
-                if (v.size() > 1)
-                {
-                    std::stringstream ss;
-                    ss << v.at(v.size()-2) << "_" << currentMeas;
-                    v.at(v.size()-2) = ss.str();
-                    ismrmrd_file = boost::algorithm::join(v, ".");
-                }
-                else
-                {
-                    // No file extension found
-                    std::stringstream ss;
-                    ss << ismrmrd_file_orig << "_" << currentMeas;
-                    ismrmrd_file = ss.str();
+    // Measurements are converted concurrently from their own streams. stdin can only be read once,
+    // compressed files and growing files are read front to back anyway.
+    // The shared memory ring has a single writer, its measurements are published in order
+    if (all_measurements && num_threads > 1 && lastMeas > firstMeas && !streaming_input && !follow &&
+        !settings.shm_ring) {
+        // The measurements are independent, convert them concurrently. Each worker reads through
+        // its own stream and converts one measurement at a time, HDF5 writes are serialized by Hdf5Output.
+        unsigned int workers = std::min(num_threads, lastMeas - firstMeas + 1);
+        std::cout << "Converting " << lastMeas - firstMeas + 1 << " measurements on " << workers << " threads"
+                  << std::endl;
+
+        std::atomic<unsigned int> next_meas(firstMeas);
+        std::atomic<bool> failed(false);
+        std::vector<int> results(lastMeas + 1, 0);
+
+        // Lines of the measurements in flight are prefixed with their number
+        MeasurementLog log;
+        std::vector<std::thread> threads;
+        for (unsigned int w = 0; w < workers; w++) {
+            threads.emplace_back([&]() {
+                unsigned int currentMeas;
+                while (!failed && (currentMeas = next_meas++) <= lastMeas) {
+                    MeasurementLog::Scope scope(log, currentMeas);
+                    try {
+                        auto stream = openSiemensDat(siemens_dat_filename, io_backend, drop_cache);
+                        results[currentMeas] = convertMeasurement(settings, *stream, currentMeas, 1);
+                    }
+                    catch (const std::exception &e) {
+                        std::cerr << "ERROR: Converting measurement " << currentMeas << " failed: " << e.what()
+                                  << std::endl;
+                        results[currentMeas] = -1;
+                    }
+                    if (results[currentMeas] != 0) failed = true;
                 }
-            }
+            });
+        }
+        for (auto &t : threads) t.join();
 
-            // Reset file position
-            if (!VBFILE)
-            {
-                siemens_dat.seekg(sizeof(MrParcRaidFileHeader), std::ios::beg);
-            }
-            else
-            {
-                siemens_dat.seekg(0, std::ios::beg);
-            }
+        for (unsigned int currentMeas = firstMeas; currentMeas <= lastMeas; currentMeas++) {
+            if (results[currentMeas] != 0) return results[currentMeas];
         }
+        return 0;
+    }
 
-        std::cout << "-----------------------------------------------------------------" << std::endl;
-        if (all_measurements)
+    for (unsigned int currentMeas = firstMeas; currentMeas <= lastMeas; currentMeas++) {
+        int result = convertMeasurement(settings, siemens_dat, currentMeas, num_threads);
+        if (result != 0) return result;
+    } // Loop through multiple measurements in multi-raid
+
+    return 0;
+}
+
+int convertMeasurement(const ConversionSettings &settings, std::istream &siemens_dat, unsigned int currentMeas,
+                       unsigned int num_threads) {
+    const bool VBFILE = settings.VBFILE;
+    const MrParcRaidFileHeader &ParcRaidHead = settings.ParcRaidHead;
+    const std::vector<MrParcRaidFileEntry> &ParcFileEntries = settings.ParcFileEntries;
+    std::string schema_file_name_content = settings.schema_file_name_content;
+    bool skip_syncdata = settings.skip_syncdata;
+
+    int measurement_number = currentMeas;
+    std::string ismrmrd_file = settings.ismrmrd_file;
+    std::string ismrmrd_group = settings.ismrmrd_group;
+
+    if (settings.all_measurements)
+    {
+        if (settings.multi_meas_file)
         {
-            std::cout << "Converting measurement " << currentMeas << "/" << lastMeas << " into file " << ismrmrd_file << " in group " << ismrmrd_group << std::endl;
+            // Add the measurement number as a suffix to the group name
+            ismrmrd_group.append("_");
+            ismrmrd_group.append(std::to_string(currentMeas));
         }
-        else
+        else if (settings.server_address.empty() && !settings.shm_ring)
         {
-            std::cout << "Converting measurement " << currentMeas << " into file " << ismrmrd_file << " in group " << ismrmrd_group << std::endl;
-        }
-        std::cout << "-----------------------------------------------------------------" << std::endl;
+            // Add the measurement number as a suffix to the filename, excluding the file extension
+            std::vector<std::string> v;
+            boost::algorithm::split(v, settings.ismrmrd_file, boost::is_any_of("."));
 
-        if (!VBFILE && measurement_number > ParcRaidHead.count_) {
-            std::cout << "The file you are trying to convert has only " << ParcRaidHead.count_ << " measurements."
-                << std::endl;
-            std::cout << "You are trying to convert measurement number: " << measurement_number << std::endl;
-            return -1;
+            if (v.size() > 1)
+            {
+                std::stringstream ss;
+                ss << v.at(v.size()-2) << "_" << currentMeas;
+                v.at(v.size()-2) = ss.str();
+                ismrmrd_file = boost::algorithm::join(v, ".");
+            }
+            else
+            {
+                // No file extension found
+                std::stringstream ss;
+                ss << settings.ismrmrd_file << "_" << currentMeas;
+                ismrmrd_file = ss.str();
+            }
         }
+    }
 
-        //if it is a VB scan
-        if (VBFILE && measurement_number != 1) {
-            std::cout << "The file you are trying to convert is a VB file and it has only one measurement." << std::endl;
-            std::cout << "You tried to convert measurement number: " << measurement_number << std::endl;
-            return -1;
-        }
+    std::string destination = !settings.server_address.empty() ? "server " + settings.server_address
+                              : settings.shm_ring ? "shared memory ring " + settings.shm_ring->name()
+                              : "file " + ismrmrd_file + " in group " + ismrmrd_group;
+    std::cout << "-----------------------------------------------------------------" << std::endl;
+    if (settings.all_measurements)
+    {
+        std::cout << "Converting measurement " << currentMeas << "/" << ParcRaidHead.count_ << " into " << destination << std::endl;
+    }
+    else
+    {
+        std::cout << "Converting measurement " << currentMeas << " into " << destination << std::endl;
+    }
+    std::cout << "-----------------------------------------------------------------" << std::endl;
 
-        // Parameter map
-        std::string default_parammap;
-        if (VBFILE) {
-            default_parammap = "IsmrmrdParameterMap_Siemens_VB17.xml";
-        } else {
-            default_parammap = "IsmrmrdParameterMap_Siemens.xml";
-        }
-        std::string parammap_actual_file = select_file(parammap_file, default_parammap, all_measurements, currentMeas);
-        std::string parammap_file_content = get_file_content(parammap_actual_file);
-        std::cout << "Using parameter map: " << parammap_actual_file << std::endl;
+    if (!VBFILE && measurement_number > ParcRaidHead.count_) {
+        std::cout << "The file you are trying to convert has only " << ParcRaidHead.count_ << " measurements."
+            << std::endl;
+        std::cout << "You are trying to convert measurement number: " << measurement_number << std::endl;
+        return -1;
+    }
 
-        std::cout << "This file contains " << ParcRaidHead.count_ << " measurement(s)." << std::endl;
+    //if it is a VB scan
+    if (VBFILE && measurement_number != 1) {
+        std::cout << "The file you are trying to convert is a VB file and it has only one measurement." << std::endl;
+        std::cout << "You tried to convert measurement number: " << measurement_number << std::endl;
+        return -1;
+    }
 
-        std::vector<MrParcRaidFileEntry> ParcFileEntries = readParcFileEntries(siemens_dat, ParcRaidHead, VBFILE);
+    // Parameter map
+    std::string default_parammap;
+    if (VBFILE) {
+        default_parammap = "IsmrmrdParameterMap_Siemens_VB17.xml";
+    } else {
+        default_parammap = "IsmrmrdParameterMap_Siemens.xml";
+    }
+    std::string parammap_actual_file = select_file(settings.parammap_file, default_parammap, settings.all_measurements, currentMeas);
+    std::string parammap_file_content = get_file_content(parammap_actual_file);
+    std::cout << "Using parameter map: " << parammap_actual_file << std::endl;
 
-        // find the beginning of the desired measurement
-        siemens_dat.seekg(ParcFileEntries[measurement_number - 1].off_, std::ios::beg);
+    std::cout << "This file contains " << ParcRaidHead.count_ << " measurement(s)." << std::endl;
 
-        uint32_t dma_length = 0, num_buffers = 0;
+    // find the beginning of the desired measurement
+    siemens_dat.seekg(ParcFileEntries[measurement_number - 1].off_, std::ios::beg);
 
-        siemens_dat.read((char*)(&dma_length), sizeof(uint32_t));
-        siemens_dat.read((char*)(&num_buffers), sizeof(uint32_t));
+    uint32_t dma_length = 0, num_buffers = 0;
 
-        //std::cout << "Measurement header DMA length: " << mhead.dma_length << std::endl;
+    siemens_dat.read((char*)(&dma_length), sizeof(uint32_t));
+    siemens_dat.read((char*)(&num_buffers), sizeof(uint32_t));
 
-        auto buffers = readMeasurementHeaderBuffers(siemens_dat, num_buffers);
+    //std::cout << "Measurement header DMA length: " << mhead.dma_length << std::endl;
 
-        //We need to be on a 32 byte boundary after reading the buffers
-        long long int position_in_meas =
-            (long long int) (siemens_dat.tellg()) - ParcFileEntries[measurement_number - 1].off_;
-        if (position_in_meas % 32 != 0) {
-            siemens_dat.seekg(32 - (position_in_meas % 32), std::ios::cur);
-        }
+    auto buffers = readMeasurementHeaderBuffers(siemens_dat, num_buffers);
 
-        // Measurement header done!
-        //Now we should have the measurement headers, so let's use the Meas header to create the XML parametersstd::string xml_config;
-        std::vector<std::string> wip_double;
-        Trajectory trajectory;
-        long dwell_time_0;
-        long max_channels;
-        long radial_views;
-        long* global_table_pos = new long[3];
-        std::string baseLineString;
-        std::string protocol_name;
-        std::string software_version;
-        std::string xml_config = readXmlConfig(debug_xml, parammap_file_content, num_buffers, buffers, wip_double,
-            trajectory, dwell_time_0,
-            max_channels, radial_views, global_table_pos, baseLineString, protocol_name, software_version);
+    //We need to be on a 32 byte boundary after reading the buffers
+    long long int position_in_meas =
+        (long long int) (siemens_dat.tellg()) - ParcFileEntries[measurement_number - 1].off_;
+    if (position_in_meas % 32 != 0) {
+        siemens_dat.seekg(32 - (position_in_meas % 32), std::ios::cur);
+    }
 
-        // whether this scan is a adjustment scan
-        bool isAdjustCoilSens = false;
-        if (protocol_name == "AdjCoilSens") {
-            isAdjustCoilSens = true;
-        }
+    // Measurement header done!
+    //Now we should have the measurement headers, so let's use the Meas header to create the XML parametersstd::string xml_config;
+    std::vector<std::string> wip_double;
+    Trajectory trajectory;
+    long dwell_time_0;
+    long max_channels;
+    long radial_views;
+    long* global_table_pos = new long[3];
+    std::string baseLineString;
+    std::string protocol_name;
+    std::string software_version;
+    std::string xml_config = readXmlConfig(settings.debug_xml, parammap_file_content, num_buffers, buffers, wip_double,
+        trajectory, dwell_time_0,
+        max_channels, radial_views, global_table_pos, baseLineString, protocol_name, software_version);
+
+    // whether this scan is a adjustment scan
+    bool isAdjustCoilSens = false;
+    if (protocol_name == "AdjCoilSens") {
+        isAdjustCoilSens = true;
+    }
 
-        bool isAdjQuietCoilSens = false;
-        if (protocol_name == "AdjQuietCoilSens") {
-            isAdjQuietCoilSens = true;
-        }
+    bool isAdjQuietCoilSens = false;
+    if (protocol_name == "AdjQuietCoilSens") {
+        isAdjQuietCoilSens = true;
+    }
 
-        // whether this scan is from VB line
-        bool isVB = false;
-        if ((baseLineString.find("VB17") != std::string::npos)
-            || (baseLineString.find("VB15") != std::string::npos)
-            || (baseLineString.find("VB13") != std::string::npos)
-            || (baseLineString.find("VB11") != std::string::npos)) {
-            isVB = true;
-        }
+    // whether this scan is from VB line
+    bool isVB = false;
+    if ((baseLineString.find("VB17") != std::string::npos)
+        || (baseLineString.find("VB15") != std::string::npos)
+        || (baseLineString.find("VB13") != std::string::npos)
+        || (baseLineString.find("VB11") != std::string::npos)) {
+        isVB = true;
+    }
 
-        std::cout << "Baseline: " << baseLineString << std::endl;
-        std::cout << "Software version: " << software_version << std::endl;
-        std::cout << "Protocol name: " << protocol_name << std::endl;
+    std::cout << "Baseline: " << baseLineString << std::endl;
+    std::cout << "Software version: " << software_version << std::endl;
+    std::cout << "Protocol name: " << protocol_name << std::endl;
 
-        bool isNX = false;
-        if ((baseLineString.find("NXVA") != std::string::npos) || (software_version.find("syngo MR XA") != std::string::npos) )
-        {
-            isNX = true;
-        }
+    bool isNX = false;
+    if ((baseLineString.find("NXVA") != std::string::npos) || (software_version.find("syngo MR XA") != std::string::npos) )
+    {
+        isNX = true;
+    }
 
-        if (isNX)
+    if (isNX)
+    {
+        int nxVersion = atoi(software_version.substr(11).c_str());
+        std::cout << "Detected Numaris/X version: " << nxVersion << std::endl;
+        if (nxVersion > 30)
         {
-            int nxVersion = atoi(software_version.substr(11).c_str());
-            std::cout << "Detected Numaris/X version: " << nxVersion << std::endl;
-            if (nxVersion > 30)
-            {
-                skip_syncdata = true;
-                std::cout << "Disabling parsing of syncdata due to incompatibility!" << std::endl;
-            }
+            skip_syncdata = true;
+            std::cout << "Disabling parsing of syncdata due to incompatibility!" << std::endl;
         }
+    }
 
-        std::cout << "Dwell time: " << dwell_time_0 << std::endl;
+    std::cout << "Dwell time: " << dwell_time_0 << std::endl;
 
-        if (debug_xml) {
-            std::ofstream o("xml_raw.xml");
-            o.write(xml_config.c_str(), xml_config.size());
-        }
+    if (settings.debug_xml) {
+        std::ofstream o("xml_raw.xml");
+        o.write(xml_config.c_str(), xml_config.size());
+    }
 
-        // Parameter style-sheet
-        std::string default_parammap_xsl;
-        if (isNX) {
-            default_parammap_xsl = "IsmrmrdParameterMap_Siemens_NX.xsl";
-        } else {
-            default_parammap_xsl = "IsmrmrdParameterMap_Siemens.xsl";
-        }
-        std::string parammap_xsl_actual_file = select_file(parammap_xsl, default_parammap_xsl, all_measurements, currentMeas);
-        std::string parammap_xsl_content = get_file_content(parammap_xsl_actual_file);
-        std::cout << "Using parameter XSL: " << parammap_xsl_actual_file << std::endl;
+    // Parameter style-sheet
+    std::string default_parammap_xsl;
+    if (isNX) {
+        default_parammap_xsl = "IsmrmrdParameterMap_Siemens_NX.xsl";
+    } else {
+        default_parammap_xsl = "IsmrmrdParameterMap_Siemens.xsl";
+    }
+    std::string parammap_xsl_actual_file = select_file(settings.parammap_xsl, default_parammap_xsl, settings.all_measurements, currentMeas);
+    std::string parammap_xsl_content = get_file_content(parammap_xsl_actual_file);
+    std::cout << "Using parameter XSL: " << parammap_xsl_actual_file << std::endl;
 
 
-        ISMRMRD::IsmrmrdHeader header;
+    ISMRMRD::IsmrmrdHeader header;
+    {
+        std::string config;
         {
-            std::string config = parseXML(debug_xml, parammap_xsl_content, schema_file_name_content, xml_config);
-            ISMRMRD::deserialize(config.c_str(), header);
+            std::lock_guard<std::mutex> lock(libxml_mutex);
+            config = parseXML(settings.debug_xml, parammap_xsl_content, schema_file_name_content, xml_config);
         }
-        //Append buffers to xml_config if requested
-        if (append_buffers) {
-            append_buffers_to_xml_header(buffers, num_buffers, header);
-        }
-
-        // Free memory used for MeasurementHeaderBuffers
+        ISMRMRD::deserialize(config.c_str(), header);
+    }
+    //Append buffers to xml_config if requested
+    if (settings.append_buffers) {
+        append_buffers_to_xml_header(buffers, num_buffers, header);
+    }
 
+    // Free memory used for MeasurementHeaderBuffers
 
-        auto ismrmrd_dataset = boost::make_shared<ISMRMRD::Dataset>(ismrmrd_file.c_str(), ismrmrd_group.c_str(), true);
-        //If this is a spiral acquisition, we will calculate the trajectory and add it to the individual profilesISMRMRD::NDArray<float> traj;
-//        auto traj = getTrajectory(wip_double, trajectory, dwell_time_0, radial_views);
-        ISMRMRD::NDArray<float> traj;
 
-        uint32_t last_mask = 0;
-        unsigned long int acquisitions = 1;
-        unsigned long int sync_data_packets = 0;
-        sMDH mdh;//For VB line
-        bool first_call = true;
+    // The output is about as large as the measurement, larger ones go to disk right away
+    uint64_t memory_limit = settings.memory_limit;
+    if (ParcFileEntries[measurement_number - 1].len_ > memory_limit) memory_limit = 0;
 
-        while (!(last_mask & 1) && //Last scan not encountered
-            (((ParcFileEntries[measurement_number - 1].off_ + ParcFileEntries[measurement_number - 1].len_) -
-                siemens_dat.tellg()) > sizeof(sScanHeader)))  //not reached end of measurement without acqend
-        {
-            size_t position_in_meas = siemens_dat.tellg();
-            sScanHeader scanhead;
-            readScanHeader(siemens_dat, VBFILE, mdh, scanhead);
+    std::unique_ptr<MrdOutput> ismrmrd_dataset;
+    if (settings.shm_ring) {
+        ismrmrd_dataset.reset(new ShmOutput(settings.shm_ring));
+    } else if (!settings.server_address.empty()) {
+        // Gadgetron expects a configuration, use its default one unless another is given
+        std::string config = settings.stream_config.empty() ? "default.xml" : settings.stream_config;
+        std::cout << "Connecting to " << settings.server_address << std::endl;
+        ismrmrd_dataset.reset(new TcpStreamOutput(settings.server_address, config, settings.reply_file));
+    } else if (settings.stream) {
+        ismrmrd_dataset.reset(new StreamOutput(ismrmrd_file, settings.stream_config));
+    } else {
+        ismrmrd_dataset.reset(new Hdf5Output(ismrmrd_file, ismrmrd_group, settings.drop_cache, settings.batch_records,
+                                             settings.batch_bytes, settings.swmr,
+                                             settings.swmr_flush_ms, memory_limit));
+    }
+    // Everything the scans are decoded with besides their own headers
+    AcquisitionParameters acquisition_parameters;
+    //If this is a spiral acquisition, we will calculate the trajectory and add it to the individual profiles
+//        acquisition_parameters.traj = getTrajectory(wip_double, trajectory, dwell_time_0, radial_views);
+    acquisition_parameters.VBFILE = VBFILE;
+    acquisition_parameters.trajectory = trajectory;
+    acquisition_parameters.dwell_time_0 = dwell_time_0;
+    acquisition_parameters.max_channels = max_channels;
+    acquisition_parameters.isAdjustCoilSens = isAdjustCoilSens;
+    acquisition_parameters.isAdjQuietCoilSens = isAdjQuietCoilSens;
+    acquisition_parameters.isVB = isVB;
+    acquisition_parameters.isNX = isNX;
+    acquisition_parameters.flash_pat_ref_scan = settings.flash_pat_ref_scan;
+    acquisition_parameters.attachTrajectory = settings.attachTrajectory;
+    const AcquisitionDecoder decoder(acquisition_parameters);
+
+    // With --threads > 1 reading, conversion and writing overlap, otherwise everything runs inline
+    bool pipelined = num_threads > 1;
+    // With --prescan the scans are located from the scan index first and the data is read
+    // by the conversion threads
+    bool indexed = pipelined && settings.prescan;
+
+    // Reader state
+    uint32_t last_mask = 0;
+    unsigned long int acquisitions = 1;
+    unsigned long int sync_data_packets = 0;
+    sMDH mdh;//For VB line
+    bool first_scan = true;
+    bool read_error = false;
+    // Writer state
+    bool first_call = true;
+    int exit_code = 0;
+    uint64_t scans_written = 0;
+    uint64_t warmup_allocations = 0;
+    uint64_t steady_allocations = 0;
+
+    // Reads the next scan header and the data block following it
+    auto read_next_scan = [&](ScanWork &work) -> bool {
+        if ((last_mask & 1) || read_error) return false; //Last scan encountered
+
+        std::streampos scan_position = siemens_dat.tellg();
+        if ((((ParcFileEntries[measurement_number - 1].off_ + ParcFileEntries[measurement_number - 1].len_) -
+              scan_position) <= sizeof(sScanHeader))) {
+            return false; //reached end of measurement without acqend
+        }
+        work.offset = scan_position;
 
-            if (!siemens_dat) {
-                std::cerr << "Error reading header at acquisition " << acquisitions << "." << std::endl;
-                break;
-            }
+        sScanHeader &scanhead = work.scanhead;
+        readScanHeader(siemens_dat, VBFILE, mdh, scanhead);
 
-            uint32_t dma_length = scanhead.ulFlagsAndDMALength & MDH_DMA_LENGTH_MASK;
-            uint32_t mdh_enable_flags = scanhead.ulFlagsAndDMALength & MDH_ENABLE_FLAGS_MASK;
+        if (!siemens_dat) {
+            std::cerr << "Error reading header at acquisition " << acquisitions << "." << std::endl;
+            return false;
+        }
 
-            //Check if this is synch data, if so, it must be handled differently.
-            if (scanhead.aulEvalInfoMask[0] & (1 << 5)) {
-                uint32_t last_scan_counter = acquisitions - 1;
+        uint32_t dma_length = scanhead.ulFlagsAndDMALength & MDH_DMA_LENGTH_MASK;
+        uint32_t mdh_enable_flags = scanhead.ulFlagsAndDMALength & MDH_ENABLE_FLAGS_MASK;
+
+        //Check if this is synch data, if so, it must be handled differently.
+        if (scanhead.aulEvalInfoMask[0] & (1 << 5)) {
+            work.kind = ScanWork::SYNCDATA;
+            work.last_scan_counter = acquisitions - 1;
+            work.block = readSyncdata(siemens_dat, VBFILE, dma_length, skip_syncdata, work.buffer,
+                                      work.block_length, pipelined);
+            sync_data_packets++;
+            return true;
+        }
 
-                auto waveforms = readSyncdata(siemens_dat, VBFILE, acquisitions, dma_length, scanhead, header,
-                                            last_scan_counter, skip_syncdata);
-                for (auto &w : waveforms)
-                    ismrmrd_dataset->appendWaveform(w);
-                sync_data_packets++;
-                continue;
+        //This check only makes sense in VD line files.
+        if (!VBFILE && (scanhead.lMeasUID != ParcFileEntries[measurement_number - 1].measId_)) {
+            //Something must have gone terribly wrong. Bail out.
+            if (first_scan) {
+                std::cerr << "Corrupted or retro-recon dataset detected (scanhead.lMeasUID != ParcFileEntries["
+                        << measurement_number - 1 << "].measId_)" << std::endl;
+                std::cerr << "Fix the scanhead.lMeasUID ... " << std::endl;
             }
+            scanhead.lMeasUID = ParcFileEntries[measurement_number - 1].measId_;
+        }
+        first_scan = false;
 
-            if (first_call) {
-                uint32_t time_stamp = scanhead.ulTimeStamp;
+        work.kind = ScanWork::ACQUISITION;
+        work.block_length = scanDataLength(VBFILE, scanhead);
 
-                // convert to acqusition date and time
-                double timeInSeconds = time_stamp * 2.5 / 1e3;
+        // Filtered out scans are passed over with a single seek, ACQEND has to be seen in any case
+        if (!(scanhead.aulEvalInfoMask[0] & 1) && !settings.filter.matches(scanhead.sLC, scanhead.aulEvalInfoMask[0])) {
+            siemens_dat.seekg(work.block_length, std::ios::cur);
+            work.kind = ScanWork::SKIPPED;
+            work.block = nullptr;
+            acquisitions++;
+            return true;
+        }
 
-                size_t hours = (size_t) (timeInSeconds / 3600);
-                size_t mins = (size_t) ((timeInSeconds - hours * 3600) / 60);
-                size_t secs = (size_t) (timeInSeconds - hours * 3600 - mins * 60);
+        work.block = readBlock(siemens_dat, work.block_length, work.buffer, pipelined);
 
-                hours = hours % 24;
-                mins  = mins  % 60;
+        if (!siemens_dat) {
+            std::cerr << "Error reading data at acquisition " << acquisitions << "." << std::endl;
+            read_error = true;
+            work.kind = ScanWork::LAST_SCAN;
+            return true;
+        }
 
-                std::string study_time = get_time_string(hours, mins, secs);
+        acquisitions++;
+        last_mask = scanhead.aulEvalInfoMask[0];
 
-                // if some of the ismrmrd header fields are not filled, here is a place to take some further actions
-                if (!fill_ismrmrd_header(header, study_date_user_supplied, study_time)) {
-                    std::cerr << "Failed to further fill XML header" << std::endl;
-                }
+        if (scanhead.aulEvalInfoMask[0] & 1) {
+            std::cout << "Last scan reached..." << std::endl;
+            work.kind = ScanWork::LAST_SCAN;
+        }
+        return true;
+    };
+
+    auto read_scan = [&](ScanWork &work) -> bool {
+        uint64_t allocations = threadAllocationCount();
+        bool read = read_next_scan(work);
+        work.allocations = threadAllocationCount() - allocations;
+        return read;
+    };
+
+    // Decodes the data block into an acquisition or waveforms, safe to run concurrently
+    auto convert_scan = [&](ScanWork &work) {
+        uint64_t allocations = threadAllocationCount();
+        if (work.kind == ScanWork::SYNCDATA) {
+            work.waveform_count = 0;
+            if (work.block_length > 0) {
+                work.waveform_count = decodeSyncdata(work.block, work.block_length, work.scanhead,
+                                                     work.last_scan_counter, work.waveforms);
+            }
+        } else if (work.kind == ScanWork::ACQUISITION) {
+            work.acquisition = &decoder.decode(work.scanhead, work.block, work.acquisitions);
+        }
+        work.allocations += threadAllocationCount() - allocations;
+    };
 
-                std::stringstream sstream;
-                ISMRMRD::serialize(header, sstream);
-                xml_config = sstream.str();
+    // Writes the converted scan, called in file order
+    // Everything before the scan being written has been decoded, its pages are not needed anymore
+    DatInputBuf *input_buf = settings.drop_cache ? dynamic_cast<DatInputBuf *>(siemens_dat.rdbuf()) : nullptr;
 
-                if (xml_file_is_valid(xml_config, schema_file_name_content) <= 0) {
-                    std::cerr << "Generated XML is not valid according to the ISMRMRD schema" << std::endl;
-                    return -1;
-                }
+    auto write_converted_scan = [&](ScanWork &work) -> bool {
+        if (input_buf) input_buf->dropCacheBefore(work.offset);
 
-                if (debug_xml) {
-                    std::ofstream o("processed.xml");
-                    o.write(xml_config.c_str(), xml_config.size());
-                }
+        if (work.kind == ScanWork::SYNCDATA) {
+            if (work.waveform_count) makeWaveformHeader(header); //Add the header if needed
+            for (size_t i = 0; i < work.waveform_count; i++)
+                ismrmrd_dataset->appendWaveform(work.waveforms[i]);
+            return true;
+        }
 
-                //This means we should only create XML header and exit
-                if (header_only) {
-                    std::ofstream header_out_file(ismrmrd_file.c_str());
-                    header_out_file << xml_config;
-                    return -1;
-                }
+        if (first_call) {
+            first_call = false;
+            uint32_t time_stamp = work.scanhead.ulTimeStamp;
 
-                // Create an ISMRMRD dataset
-            }
+            // convert to acqusition date and time
+            double timeInSeconds = time_stamp * 2.5 / 1e3;
 
-            //This check only makes sense in VD line files.
-            if (!VBFILE && (scanhead.lMeasUID != ParcFileEntries[measurement_number - 1].measId_)) {
-                //Something must have gone terribly wrong. Bail out.
-                if (first_call) {
-                    std::cerr << "Corrupted or retro-recon dataset detected (scanhead.lMeasUID != ParcFileEntries["
-                            << measurement_number - 1 << "].measId_)" << std::endl;
-                    std::cerr << "Fix the scanhead.lMeasUID ... " << std::endl;
-                }
-                scanhead.lMeasUID = ParcFileEntries[measurement_number - 1].measId_;
-            }
+            size_t hours = (size_t) (timeInSeconds / 3600);
+            size_t mins = (size_t) ((timeInSeconds - hours * 3600) / 60);
+            size_t secs = (size_t) (timeInSeconds - hours * 3600 - mins * 60);
 
-            if (first_call) first_call = false;
+            hours = hours % 24;
+            mins  = mins  % 60;
 
-            //Allocate data for channels
-            std::vector<ChannelHeaderAndData> channels = readChannelHeaders(siemens_dat, VBFILE, scanhead);
+            std::string study_time = get_time_string(hours, mins, secs);
 
-            if (!siemens_dat) {
-                std::cerr << "Error reading data at acquisition " << acquisitions << "." << std::endl;
-                break;
+            // if some of the ismrmrd header fields are not filled, here is a place to take some further actions
+            if (!fill_ismrmrd_header(header, settings.study_date_user_supplied, study_time)) {
+                std::cerr << "Failed to further fill XML header" << std::endl;
             }
 
-            acquisitions++;
-            last_mask = scanhead.aulEvalInfoMask[0];
+            std::stringstream sstream;
+            ISMRMRD::serialize(header, sstream);
+            xml_config = sstream.str();
 
-            if (scanhead.aulEvalInfoMask[0] & 1) {
-                std::cout << "Last scan reached..." << std::endl;
-                break;
+            int xml_valid;
+            {
+                std::lock_guard<std::mutex> lock(libxml_mutex);
+                xml_valid = xml_file_is_valid(xml_config, schema_file_name_content);
+            }
+            if (xml_valid <= 0) {
+                std::cerr << "Generated XML is not valid according to the ISMRMRD schema" << std::endl;
+                exit_code = -1;
+                return false;
             }
 
-            ismrmrd_dataset->appendAcquisition(
-                    getAcquisition(flash_pat_ref_scan, trajectory, dwell_time_0, global_table_pos, max_channels, isAdjustCoilSens,
-                                isAdjQuietCoilSens, isVB, isNX, attachTrajectory, traj, scanhead, channels));
+            if (settings.debug_xml) {
+                std::ofstream o("processed.xml");
+                o.write(xml_config.c_str(), xml_config.size());
+            }
 
-        }//End of the while loop
-        delete [] global_table_pos;
+            //This means we should only create XML header and exit
+            if (settings.header_only) {
+                std::ofstream header_out_file(ismrmrd_file.c_str());
+                header_out_file << xml_config;
+                exit_code = -1;
+                return false;
+            }
 
-        if (!siemens_dat) {
-            std::cerr << "WARNING: Unexpected error.  Please check the result." << std::endl;
-            return -1;
+            ismrmrd_dataset->beginMeasurement(xml_config);
         }
 
-        ismrmrd_dataset->writeHeader(xml_config);
-
-        //Mystery bytes. There seems to be 160 mystery bytes at the end of the data.
-        std::streamoff mystery_bytes = (std::streamoff) (ParcFileEntries[measurement_number - 1].off_ +
-                                                        ParcFileEntries[measurement_number - 1].len_) -
-                                    siemens_dat.tellg();
-
-        if (mystery_bytes > 0) {
-            if (mystery_bytes != MYSTERY_BYTES_EXPECTED) {
-                // Something in not quite right
-                std::cerr << "WARNING: Unexpected number of mystery bytes detected: " << mystery_bytes << std::endl;
-                std::cerr << "ParcFileEntries[" << measurement_number - 1 << "].off_ = "
-                        << ParcFileEntries[measurement_number - 1].off_ << std::endl;
-                std::cerr << "ParcFileEntries[" << measurement_number - 1 << "].len_ = "
-                        << ParcFileEntries[measurement_number - 1].len_ << std::endl;
-                std::cerr << "siemens_dat.tellg() = " << siemens_dat.tellg() << std::endl;
-                std::cerr << "Please check the result." << std::endl;
-            } else {
-                // Read the mystery bytes
-                char mystery_data[MYSTERY_BYTES_EXPECTED];
-                siemens_dat.read(reinterpret_cast<char *>(&mystery_data), mystery_bytes);
-                //After this we have to be on a 512 byte boundary
-                if (siemens_dat.tellg() % 512) {
-                    siemens_dat.seekg(512 - (siemens_dat.tellg() % 512), std::ios::cur);
-                }
+        if (work.kind == ScanWork::ACQUISITION) {
+            ismrmrd_dataset->appendAcquisition(*work.acquisition);
+            // Reported by the writer, so the progress follows the output with --threads as well
+            if (work.scanhead.ulScanCounter % 1000 == 0) {
+                std::cout << "wrote scan : " << work.scanhead.ulScanCounter << std::endl;
             }
         }
-
-        size_t end_position = siemens_dat.tellg();
-        siemens_dat.seekg(0, std::ios::end);
-        size_t eof_position = siemens_dat.tellg();
-        if (end_position != eof_position && ParcRaidHead.count_ == measurement_number) {
-            size_t additional_bytes = eof_position - end_position;
-            std::cerr << "WARNING: End of file was not reached during conversion. There are " <<
-                    additional_bytes << " additional bytes at the end of file." << std::endl;
+        return true;
+    };
+
+    // The writer runs on a single thread, it also keeps the allocation statistics
+    auto write_scan = [&](ScanWork &work) -> bool {
+        uint64_t allocations = threadAllocationCount();
+        bool keep_going = write_converted_scan(work);
+        allocations = work.allocations + threadAllocationCount() - allocations;
+        if (scans_written++ < ALLOCATION_WARMUP_SCANS) {
+            warmup_allocations += allocations;
+        } else {
+            steady_allocations += allocations;
         }
-    } // Loop through multiple measurements in multi-raid
-
-    return 0;
-}
-
-std::vector<ChannelHeaderAndData>
-readChannelHeaders(std::ifstream &siemens_dat, bool VBFILE, const sScanHeader &scanhead) {
-    size_t nchannels = scanhead.ushUsedChannels;
-    auto channels = std::vector<ChannelHeaderAndData>(nchannels);
-    
-    for (unsigned int c = 0; c < nchannels; c++) {
-        if (VBFILE) {
-            if (c == 0) {
-                // Rewind to read mdh again 
-                // It was read once to create scanhead 
-                // Not all parameters are present in scanhead
-                siemens_dat.seekg(-sizeof(sMDH), std::ios_base::cur);
-            }
-            sMDH mdh;
-            siemens_dat.read(reinterpret_cast<char*>(&mdh), sizeof(sMDH));
-            channels[c].header.ulTypeAndChannelLength = 0;
-            channels[c].header.lMeasUID = mdh.lMeasUID;
-            channels[c].header.ulScanCounter = mdh.ulScanCounter;
-            channels[c].header.ulReserved1 = 0;
-            channels[c].header.ulSequenceTime = 0;
-            channels[c].header.ulUnused2 = 0;
-            channels[c].header.ulChannelId = mdh.ushChannelId;
-            channels[c].header.ulUnused3 = 0;
-            channels[c].header.ulCRC = 0;
+        return keep_going;
+    };
+
+    // Use the sidecar scan index if it has this measurement, otherwise walk the scan headers first
+    MeasurementIndex walked_index;
+    const MeasurementIndex *found_index = nullptr;
+    auto get_measurement_index = [&]() -> const MeasurementIndex * {
+        if (found_index) return found_index;
+        uint64_t data_offset = siemens_dat.tellg();
+        if (settings.scan_index && (size_t) measurement_number <= settings.scan_index->measurements.size() &&
+            settings.scan_index->measurements[measurement_number - 1].data_offset == data_offset) {
+            found_index = &settings.scan_index->measurements[measurement_number - 1];
         } else {
-            siemens_dat.read(reinterpret_cast<char *>(&channels[c].header), sizeof(sChannelHeader));
+            walked_index = indexMeasurement(siemens_dat, VBFILE, ParcFileEntries[measurement_number - 1], data_offset);
+            found_index = &walked_index;
         }
-
-        size_t nsamples = scanhead.ushSamplesInScan;
-        channels[c].data = std::vector<complex_float_t>(nsamples);
-        siemens_dat.read(reinterpret_cast<char *>(&channels[c].data[0]), nsamples * sizeof(complex_float_t));
-    }
-    return channels;
-}
-
-void readScanHeader(std::ifstream &siemens_dat, bool VBFILE, sMDH &mdh, sScanHeader &scanhead) {
-    siemens_dat.read(reinterpret_cast<char *>(&scanhead.ulFlagsAndDMALength), sizeof(uint32_t));
-
-    if (VBFILE) {
-        siemens_dat.read(reinterpret_cast<char *>(&mdh) + sizeof(uint32_t), sizeof(sMDH) - sizeof(uint32_t));
-        scanhead.lMeasUID = mdh.lMeasUID;
-        scanhead.ulScanCounter = mdh.ulScanCounter;
-        scanhead.ulTimeStamp = mdh.ulTimeStamp;
-        scanhead.ulPMUTimeStamp = mdh.ulPMUTimeStamp;
-        scanhead.ushSystemType = 0;
-        scanhead.ulPTABPosDelay = 0;
-        scanhead.lPTABPosX = 0;
-        scanhead.lPTABPosY = 0;
-        scanhead.lPTABPosZ = mdh.ushPTABPosNeg;//TODO: Modify calculation
-        scanhead.ulReserved1 = 0;
-        scanhead.aulEvalInfoMask[0] = mdh.aulEvalInfoMask[0];
-        scanhead.aulEvalInfoMask[1] = mdh.aulEvalInfoMask[1];
-        scanhead.ushSamplesInScan = mdh.ushSamplesInScan;
-        scanhead.ushUsedChannels = mdh.ushUsedChannels;
-        scanhead.sLC = mdh.sLC;
-        scanhead.sCutOff = mdh.sCutOff;
-        scanhead.ushKSpaceCentreColumn = mdh.ushKSpaceCentreColumn;
-        scanhead.ushCoilSelect = mdh.ushCoilSelect;
-        scanhead.fReadOutOffcentre = mdh.fReadOutOffcentre;
-        scanhead.ulTimeSinceLastRF = mdh.ulTimeSinceLastRF;
-        scanhead.ushKSpaceCentreLineNo = mdh.ushKSpaceCentreLineNo;
-        scanhead.ushKSpaceCentrePartitionNo = mdh.ushKSpaceCentrePartitionNo;
-        scanhead.sSliceData = mdh.sSliceData;
-        memset(scanhead.aushIceProgramPara, 0, sizeof(uint16_t) * 24);
-        memcpy(scanhead.aushIceProgramPara, mdh.aushIceProgramPara, 8 * sizeof(uint16_t));
-        memset(scanhead.aushReservedPara, 0, sizeof(uint16_t) * 4);
-        scanhead.ushApplicationCounter = 0;
-        scanhead.ushApplicationMask = 0;
-        scanhead.ulCRC = 0;
-    } else {
-        siemens_dat.read(reinterpret_cast<char *>(&scanhead) + sizeof(uint32_t),
-                         sizeof(sScanHeader) - sizeof(uint32_t));
+        return found_index;
+    };
+
+    // Count the acquisitions that will be written and let the output allocate their space up front.
+    // Sync data only adds its packet size to the estimate, the number of waveforms is not known before
+    // the packets are decoded.
+    if (settings.presize && settings.fetch.empty()) {
+        uint64_t data_offset = siemens_dat.tellg();
+        const MeasurementIndex *measurement_index = get_measurement_index();
+        siemens_dat.clear();
+        siemens_dat.seekg(data_offset, std::ios::beg);
+
+        size_t expected_acquisitions = 0;
+        uint64_t expected_bytes = 0;
+        for (const auto &scan : measurement_index->scans) {
+            if (scan.eval_info_mask[0] & MDH_SYNCDATA) {
+                expected_bytes += scan.data_length;
+            } else if (!(scan.eval_info_mask[0] & 1) && settings.filter.matches(scan.lc, scan.eval_info_mask[0])) {
+                expected_acquisitions++;
+                expected_bytes += sizeof(ISMRMRD::AcquisitionHeader) +
+                                  (uint64_t) scan.samples * scan.channels * sizeof(complex_float_t);
+            }
+        }
+        ismrmrd_dataset->reserve(expected_acquisitions, expected_bytes);
     }
-}
 
-ISMRMRD::Acquisition
-getAcquisition(bool flash_pat_ref_scan, const Trajectory &trajectory, long dwell_time_0, long* global_table_pos, long max_channels,
-               bool isAdjustCoilSens, bool isAdjQuietCoilSens, bool isVB, bool isNX, bool attachTrajectory, ISMRMRD::NDArray<float> &traj,
-               const sScanHeader &scanhead, const std::vector<ChannelHeaderAndData> &channels) {
-    ISMRMRD::Acquisition ismrmrd_acq;
-    // The number of samples, channels and trajectory dimensions is set below
-
-    // Acquisition header values are zero by default
-    ismrmrd_acq.measurement_uid() = scanhead.lMeasUID;
-    ismrmrd_acq.scan_counter() = scanhead.ulScanCounter;
-    ismrmrd_acq.acquisition_time_stamp() = scanhead.ulTimeStamp;
-    ismrmrd_acq.physiology_time_stamp()[0] = scanhead.ulPMUTimeStamp;
-    ismrmrd_acq.available_channels() = (uint16_t) max_channels;
-    // uint64_t channel_mask[16];     //Mask to indicate which channels are active. Support for 1024 channels
-    ismrmrd_acq.discard_pre() = scanhead.sCutOff.ushPre;
-    ismrmrd_acq.discard_post() = scanhead.sCutOff.ushPost;
-    ismrmrd_acq.center_sample() = scanhead.ushKSpaceCentreColumn;
-
-    // std::cout << "isAdjustCoilSens, isVB : " << isAdjustCoilSens << " " << isVB << std::endl;
-
-    if (scanhead.aulEvalInfoMask[0] & (1ULL << 25))
-    { //This is noise
-        ismrmrd_acq.sample_time_us() = compute_noise_sample_in_us(scanhead.ushSamplesInScan, isAdjustCoilSens,
-                                                                  isAdjQuietCoilSens, isVB, isNX);
-
-        // std::cout << "Noise sample time us :" << ismrmrd_acq.sample_time_us() << std::endl;
-    } else {
-        ismrmrd_acq.sample_time_us() = dwell_time_0 / 1000.0f;
-    }
-    // std::cout << "ismrmrd_acq.sample_time_us(): " << ismrmrd_acq.sample_time_us() << std::endl;
-
-    ismrmrd_acq.position()[0] = scanhead.sSliceData.sSlicePosVec.flSag;// + (float) (global_table_pos[0]);
-    ismrmrd_acq.position()[1] = scanhead.sSliceData.sSlicePosVec.flCor;// + (float) (global_table_pos[1]);
-    ismrmrd_acq.position()[2] = scanhead.sSliceData.sSlicePosVec.flTra;// + (float) (global_table_pos[2]);
-
-    // Convert Siemens quaternions to direction cosines.
-    // In the Siemens convention the quaternion corresponds to a rotation matrix with columns P R S
-    // Siemens stores the quaternion as (W,X,Y,Z)
-    float quat[4];
-    quat[0] = scanhead.sSliceData.aflQuaternion[1]; // X
-    quat[1] = scanhead.sSliceData.aflQuaternion[2]; // Y
-    quat[2] = scanhead.sSliceData.aflQuaternion[3]; // Z
-    quat[3] = scanhead.sSliceData.aflQuaternion[0]; // W
-    ISMRMRD::ismrmrd_quaternion_to_directions(quat,
-                                              ismrmrd_acq.phase_dir(),
-                                              ismrmrd_acq.read_dir(),
-                                              ismrmrd_acq.slice_dir());
-
-    //std::cout << "scanhead.ulScanCounter         = " << scanhead.ulScanCounter << std::endl;
-    //std::cout << "quat         = [" << quat[0] << " " << quat[1] << " " << quat[2] << " " << quat[3] << "]" << std::endl;
-    //std::cout << "phase_dir    = [" << ismrmrd_acq.phase_dir()[0] << " " << ismrmrd_acq.phase_dir()[1] << " " << ismrmrd_acq.phase_dir()[2] << "]" << std::endl;
-    //std::cout << "read_dir     = [" << ismrmrd_acq.read_dir()[0] << " " << ismrmrd_acq.read_dir()[1] << " " << ismrmrd_acq.read_dir()[2] << "]" << std::endl;
-    //std::cout << "slice_dir    = [" << ismrmrd_acq.slice_dir()[0] << " " << ismrmrd_acq.slice_dir()[1] << " " << ismrmrd_acq.slice_dir()[2] << "]" << std::endl;
-    //std::cout << "--------------------------------------------------------" << std::endl;
-
-    ismrmrd_acq.patient_table_position()[0] = (float) scanhead.lPTABPosX;
-    ismrmrd_acq.patient_table_position()[1] = (float) scanhead.lPTABPosY;
-    ismrmrd_acq.patient_table_position()[2] = (float) scanhead.lPTABPosZ;
-
-    bool fixedE1E2 = true;
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 25))) fixedE1E2 = false; // noise
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) fixedE1E2 = false; // navigator, rt feedback
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 2))) fixedE1E2 = false; // hp feedback
-    if ((scanhead.aulEvalInfoMask[1] & (1ULL << 51-32))) fixedE1E2 = false; // dummy
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 5))) fixedE1E2 = false; // synch data
-
-    ismrmrd_acq.idx().average = scanhead.sLC.ushAcquisition;
-    ismrmrd_acq.idx().contrast = scanhead.sLC.ushEcho;
-    ismrmrd_acq.idx().kspace_encode_step_1 = scanhead.sLC.ushLine;
-    ismrmrd_acq.idx().kspace_encode_step_2 = scanhead.sLC.ushPartition;
-    ismrmrd_acq.idx().phase = scanhead.sLC.ushPhase;
-    ismrmrd_acq.idx().repetition = scanhead.sLC.ushRepetition;
-    ismrmrd_acq.idx().segment = scanhead.sLC.ushSeg;
-    ismrmrd_acq.idx().set = scanhead.sLC.ushSet;
-    ismrmrd_acq.idx().slice = scanhead.sLC.ushSlice;
-    ismrmrd_acq.idx().user[0] = scanhead.sLC.ushIda;
-    ismrmrd_acq.idx().user[1] = scanhead.sLC.ushIdb;
-    ismrmrd_acq.idx().user[2] = scanhead.sLC.ushIdc;
-    ismrmrd_acq.idx().user[3] = scanhead.sLC.ushIdd;
-    ismrmrd_acq.idx().user[4] = scanhead.sLC.ushIde;
-    // TODO: remove this once the GTPlus can properly autodetect partial fourier
-    ismrmrd_acq.idx().user[5] = scanhead.ushKSpaceCentreLineNo;
-    ismrmrd_acq.idx().user[6] = scanhead.ushKSpaceCentrePartitionNo;
-
-    /*****************************************************************************/
-    /* the user_int[0] and user_int[1] are used to store user defined parameters */
-    /*****************************************************************************/
-    ismrmrd_acq.user_int()[0] = scanhead.aushIceProgramPara[0];
-    ismrmrd_acq.user_int()[1] = scanhead.aushIceProgramPara[1];
-    ismrmrd_acq.user_int()[2] = scanhead.aushIceProgramPara[2];
-    ismrmrd_acq.user_int()[3] = scanhead.aushIceProgramPara[3];
-    ismrmrd_acq.user_int()[4] = scanhead.aushIceProgramPara[4];
-    ismrmrd_acq.user_int()[5] = scanhead.aushIceProgramPara[5];
-    ismrmrd_acq.user_int()[6] = scanhead.aushIceProgramPara[6];
-    // TODO: in the newer version of ismrmrd, add field to store time_since_perp_pulse
-    ismrmrd_acq.user_int()[7] = scanhead.ulTimeSinceLastRF;
-
-    ismrmrd_acq.user_float()[0] = scanhead.aushIceProgramPara[8];
-    ismrmrd_acq.user_float()[1] = scanhead.aushIceProgramPara[9];
-    ismrmrd_acq.user_float()[2] = scanhead.aushIceProgramPara[10];
-    ismrmrd_acq.user_float()[3] = scanhead.aushIceProgramPara[11];
-    ismrmrd_acq.user_float()[4] = scanhead.aushIceProgramPara[12];
-    ismrmrd_acq.user_float()[5] = scanhead.aushIceProgramPara[13];
-    ismrmrd_acq.user_float()[6] = scanhead.aushIceProgramPara[14];
-    ismrmrd_acq.user_float()[7] = scanhead.aushIceProgramPara[15];
-
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 25))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_NOISE_MEASUREMENT);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 28))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_FIRST_IN_SLICE);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 29))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_SLICE);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 11))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_REPETITION);
-
-    /// if a line is both image and ref, then do not set the ref flag
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 23))) {
-        ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION_AND_IMAGING);
-    } else {
-        if ((scanhead.aulEvalInfoMask[0] & (1ULL << 22)))
-            ismrmrd_acq.setFlag(
-                    ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION);
-    }
+    if (!settings.fetch.empty()) {
+        const MeasurementIndex *measurement_index = get_measurement_index();
+        AcquisitionFetcher fetcher(settings.siemens_dat_filename, settings.io_backend, *measurement_index,
+                                   acquisition_parameters, ParcFileEntries[measurement_number - 1].measId_);
+        const IndexedScanReader &scan_reader = fetcher.reader();
 
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 24))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_REVERSE);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 11))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_MEASUREMENT);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 21))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PHASECORR_DATA);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_NAVIGATION_DATA);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_RTFEEDBACK_DATA);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 2))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_HPFEEDBACK_DATA);
-    if ((scanhead.aulEvalInfoMask[1] & (1ULL << 51-32))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_DUMMYSCAN_DATA);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 10)))
-        ismrmrd_acq.setFlag(
-                ISMRMRD::ISMRMRD_ACQ_IS_SURFACECOILCORRECTIONSCAN_DATA);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 5))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_DUMMYSCAN_DATA);
-    // if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_REPETITION);
+        std::vector<size_t> selected;
+        for (const auto &query : settings.fetch) {
+            auto found = scan_reader.find(query);
+            selected.insert(selected.end(), found.begin(), found.end());
+        }
+        std::sort(selected.begin(), selected.end());
+        selected.erase(std::unique(selected.begin(), selected.end()), selected.end());
+        std::cout << "Fetching " << selected.size() << " of " << measurement_index->scans.size() << " scans"
+                  << std::endl;
+
+        // The header takes the study time from the first scan of the measurement, as in a full conversion
+        std::vector<size_t> scans_to_read;
+        ScanQuery any_scan;
+        auto first = scan_reader.find(any_scan);
+        if (!first.empty() && (selected.empty() || first[0] != selected[0])) scans_to_read.push_back(first[0]);
+        scans_to_read.insert(scans_to_read.end(), selected.begin(), selected.end());
+
+        ScanWork work;
+        for (size_t i : scans_to_read) {
+            const ScanIndexEntry &scan = measurement_index->scans[i];
+            uint64_t allocations = threadAllocationCount();
+            work.offset = scan.offset;
+
+            // ACQEND scans are never written
+            bool wanted = std::binary_search(selected.begin(), selected.end(), i) && !(scan.eval_info_mask[0] & 1) &&
+                          settings.filter.matches(scan.lc, scan.eval_info_mask[0]);
+            if (wanted) {
+                work.kind = ScanWork::ACQUISITION;
+                work.acquisition = &fetcher.fetch(i, work.scanhead, work.acquisitions);
+            } else {
+                work.kind = ScanWork::SKIPPED;
+                fetcher.readHeader(i, work.scanhead);
+            }
+            work.allocations = threadAllocationCount() - allocations;
+            if (!write_scan(work)) break;
+        }
 
-    if ((scanhead.aulEvalInfoMask[1] & (1ULL << 46-32))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_MEASUREMENT);
+        siemens_dat.seekg(measurement_index->end_offset, std::ios::beg);
+    } else if (indexed) {
+        const MeasurementIndex *measurement_index = get_measurement_index();
+        const std::vector<ScanIndexEntry> &scans = measurement_index->scans;
+        std::cout << "Indexed " << scans.size() << " scans" << std::endl;
+
+        PositionalDatFile dat_file(settings.siemens_dat_filename, settings.io_backend, settings.drop_cache);
+        size_t header_length = VBFILE ? sizeof(sMDH) : sizeof(sScanHeader);
+        size_t next_scan = 0;
+
+        // Hands out the indexed scans with the same bookkeeping and messages as read_scan
+        auto next_indexed_scan = [&](ScanWork &work) -> bool {
+            if (next_scan == scans.size()) {
+                if (measurement_index->end_reason == MeasurementIndex::HEADER_ERROR && !read_error) {
+                    std::cerr << "Error reading header at acquisition " << acquisitions << "." << std::endl;
+                    read_error = true;
+                }
+                return false;
+            }
 
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 14))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PHASE_STABILIZATION_REFERENCE);
-    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 15))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PHASE_STABILIZATION);
+            const ScanIndexEntry &scan = scans[next_scan++];
+            work.offset = scan.offset;
+            work.block_length = scan.data_length;
 
-    if ((flash_pat_ref_scan) & (ismrmrd_acq.isFlagSet(ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION))) {
-        // For some sequences the PAT Reference data is collected using a different encoding space
-        // e.g. EPI scans with FLASH PAT Reference
-        // enabled by command line option
-        // TODO: it is likely that the dwell time is not set properly for this type of acquisition
-        ismrmrd_acq.encoding_space_ref() = 1;
-    }
+            if (scan.eval_info_mask[0] & MDH_SYNCDATA) {
+                work.kind = ScanWork::SYNCDATA;
+                work.last_scan_counter = acquisitions - 1;
+                if (VBFILE || skip_syncdata) work.block_length = 0;
+                sync_data_packets++;
+                return true;
+            }
 
-    if (attachTrajectory && (trajectory == Trajectory::TRAJECTORY_SPIRAL) & !(ismrmrd_acq.isFlagSet(
-            ISMRMRD::ISMRMRD_ACQ_IS_NOISE_MEASUREMENT))) { //Spiral and not noise, we will add the trajectory to the data
+            if (!VBFILE && (scan.meas_uid != (int32_t) ParcFileEntries[measurement_number - 1].measId_) && first_scan) {
+                std::cerr << "Corrupted or retro-recon dataset detected (scanhead.lMeasUID != ParcFileEntries["
+                        << measurement_number - 1 << "].measId_)" << std::endl;
+                std::cerr << "Fix the scanhead.lMeasUID ... " << std::endl;
+            }
+            first_scan = false;
 
-        // from above we have the following
-        // traj_dim[0] = dimensionality (2)
-        // traj_dim[1] = ngrad i.e. points per interleaf
-        // traj_dim[2] = no. of interleaves
-        // and
-        // traj.getData() is a float * pointer to the trajectory stored
-        // kspace_encode_step_1 is the interleaf number
+            work.kind = ScanWork::ACQUISITION;
+            if (next_scan == scans.size() && measurement_index->end_reason == MeasurementIndex::DATA_ERROR) {
+                std::cerr << "Error reading data at acquisition " << acquisitions << "." << std::endl;
+                read_error = true;
+                work.kind = ScanWork::LAST_SCAN;
+                work.block_length = 0;
+                return true;
+            }
 
-        // Set the acquisition number of samples, channels and trajectory dimensions
-        // this reallocates the memory
-        auto traj_dim = traj.getDims();
-        ismrmrd_acq.resize(scanhead.ushSamplesInScan,
-                           scanhead.ushUsedChannels,
-                           traj_dim[0]);
+            acquisitions++;
 
-        unsigned long traj_samples_to_copy = ismrmrd_acq.number_of_samples();
-        if (traj_dim[1] < traj_samples_to_copy) {
-            traj_samples_to_copy = (unsigned long) traj_dim[1];
-            ismrmrd_acq.discard_post() = (uint16_t) (ismrmrd_acq.number_of_samples() - traj_samples_to_copy);
+            if (scan.eval_info_mask[0] & 1) {
+                std::cout << "Last scan reached..." << std::endl;
+                work.kind = ScanWork::LAST_SCAN;
+            } else if (!settings.filter.matches(scan.lc, scan.eval_info_mask[0])) {
+                work.kind = ScanWork::SKIPPED;
+                work.block_length = 0;
+            }
+            return true;
+        };
+
+        // Header and data are contiguous, fetch them with a single positional read
+        auto read_and_convert_scan = [&](ScanWork &work) {
+            uint64_t allocations = threadAllocationCount();
+            const char *scan = dat_file.read(work.offset, header_length + work.block_length, work.buffer);
+            decodeScanHeader(scan, VBFILE, work.scanhead);
+            work.block = scan + header_length;
+            if (work.kind != ScanWork::SYNCDATA && !VBFILE) {
+                work.scanhead.lMeasUID = ParcFileEntries[measurement_number - 1].measId_;
+            }
+            work.allocations = threadAllocationCount() - allocations;
+            convert_scan(work);
+        };
+
+        // Scans are written in file order, the workers only read scans after the one being written
+        auto write_indexed_scan = [&](ScanWork &work) -> bool {
+            if (settings.drop_cache) dat_file.dropCacheBefore(work.offset);
+            return write_scan(work);
+        };
+
+        runPipeline<ScanWork>(num_threads, PIPELINE_DEPTH_PER_THREAD * num_threads,
+                              next_indexed_scan, read_and_convert_scan, write_indexed_scan);
+
+        // Leave the stream where reading the scans would have
+        if (read_error) {
+            siemens_dat.setstate(std::ios::failbit);
+        } else {
+            siemens_dat.seekg(measurement_index->end_offset, std::ios::beg);
+        }
+    } else if (pipelined) {
+        runPipeline<ScanWork>(num_threads, PIPELINE_DEPTH_PER_THREAD * num_threads,
+                              read_scan, convert_scan, write_scan);
+    } else {
+        ScanWork work;
+        while (read_scan(work)) {
+            convert_scan(work);
+            if (!write_scan(work)) break;
         }
-        float *t_ptr = &traj.getDataPtr()[traj_dim[0] * traj_dim[1] * ismrmrd_acq.idx().kspace_encode_step_1];
-        memcpy((void *) ismrmrd_acq.getTrajPtr(), t_ptr, sizeof(float) * traj_dim[0] * traj_samples_to_copy);
-    } else { //No trajectory
-        // Set the acquisition number of samples, channels and trajectory dimensions
-        // this reallocates the memory
-        ismrmrd_acq.resize(scanhead.ushSamplesInScan, scanhead.ushUsedChannels);
     }
 
-    for (unsigned int c = 0; c < ismrmrd_acq.active_channels(); c++) {
-        memcpy((complex_float_t *) &(ismrmrd_acq.getDataPtr()[c * ismrmrd_acq.number_of_samples()]),
-               &channels[c].data[0], ismrmrd_acq.number_of_samples() * sizeof(complex_float_t));
+    if (settings.alloc_stats) {
+        // HDF5 allocates with malloc behind the counter's back, its allocations are not included
+        std::cout << "Heap allocations: " << warmup_allocations << " in the first "
+                  << std::min(scans_written, ALLOCATION_WARMUP_SCANS) << " scans, " << steady_allocations
+                  << " in the following " << (scans_written - std::min(scans_written, ALLOCATION_WARMUP_SCANS))
+                  << " scans" << std::endl;
     }
 
-
-    if (scanhead.ulScanCounter % 1000 == 0) {
-        std::cout << "wrote scan : " << scanhead.ulScanCounter << std::endl;
+    if (exit_code != 0) {
+        delete [] global_table_pos;
+        return exit_code;
     }
+    delete [] global_table_pos;
 
-    return ismrmrd_acq;
-}
-
-std::tuple<std::vector<uint32_t>, std::vector<uint32_t>> unpack_pmu(const std::vector<PMUdata> &data) {
+    if (!siemens_dat) {
+        std::cerr << "WARNING: Unexpected error.  Please check the result." << std::endl;
+        return -1;
+    }
 
-    auto tup = std::make_tuple(std::vector<uint32_t>(), std::vector<uint32_t>());
-    std::get<0>(tup).reserve(data.size());
-    std::get<1>(tup).reserve(data.size());
+    ismrmrd_dataset->writeHeader(xml_config);
+
+    //Mystery bytes. There seems to be 160 mystery bytes at the end of the data.
+    std::streamoff mystery_bytes = (std::streamoff) (ParcFileEntries[measurement_number - 1].off_ +
+                                                    ParcFileEntries[measurement_number - 1].len_) -
+                                siemens_dat.tellg();
+
+    if (mystery_bytes > 0 && ParcFileEntries[measurement_number - 1].len_ != UNKNOWN_MEASUREMENT_LENGTH) {
+        if (mystery_bytes != MYSTERY_BYTES_EXPECTED) {
+            // Something in not quite right
+            std::cerr << "WARNING: Unexpected number of mystery bytes detected: " << mystery_bytes << std::endl;
+            std::cerr << "ParcFileEntries[" << measurement_number - 1 << "].off_ = "
+                    << ParcFileEntries[measurement_number - 1].off_ << std::endl;
+            std::cerr << "ParcFileEntries[" << measurement_number - 1 << "].len_ = "
+                    << ParcFileEntries[measurement_number - 1].len_ << std::endl;
+            std::cerr << "siemens_dat.tellg() = " << siemens_dat.tellg() << std::endl;
+            std::cerr << "Please check the result." << std::endl;
+        } else {
+            // Read the mystery bytes
+            char mystery_data[MYSTERY_BYTES_EXPECTED];
+            siemens_dat.read(reinterpret_cast<char *>(&mystery_data), mystery_bytes);
+            //After this we have to be on a 512 byte boundary
+            if (siemens_dat.tellg() % 512) {
+                siemens_dat.seekg(512 - (siemens_dat.tellg() % 512), std::ios::cur);
+            }
+        }
+    }
 
-    for (auto d : data) {
+    // The size of a streamed or growing input is not known, and seeking to its end would fail the stream
+    if (settings.streaming_input || settings.follow_input) return 0;
 
-        std::get<0>(tup).push_back(d.data);
-        std::get<1>(tup).push_back(d.trigger);
+    size_t end_position = siemens_dat.tellg();
+    siemens_dat.seekg(0, std::ios::end);
+    size_t eof_position = siemens_dat.tellg();
+    if (end_position != eof_position && ParcRaidHead.count_ == measurement_number) {
+        size_t additional_bytes = eof_position - end_position;
+        std::cerr << "WARNING: End of file was not reached during conversion. There are " <<
+                additional_bytes << " additional bytes at the end of file." << std::endl;
     }
-    return tup;
-}
 
+    return 0;
+}
 
 void makeWaveformHeader(ISMRMRD::IsmrmrdHeader &header) {
 
@@ -1363,155 +1806,205 @@ const std::map<PMU_Type, int> waveformId = {{PMU_Type::ECG1, 0},
 std::set<PMU_Type> PMU_Types = {PMU_Type::ECG1, PMU_Type::ECG2, PMU_Type::ECG3, PMU_Type::ECG4, PMU_Type::PULS,
                                 PMU_Type::RESP, PMU_Type::EXT1, PMU_Type::EXT2, PMU_Type::END};
 
-std::vector<ISMRMRD::Waveform> readSyncdata(std::ifstream &siemens_dat, bool VBFILE, unsigned long acquisitions,
-                                            uint32_t dma_length, sScanHeader scanheader, ISMRMRD::IsmrmrdHeader &header,
-                                            long last_scan_counter, bool skip_syncdata) {
-
-    size_t len = 0;
-    if (VBFILE) {
-        len = dma_length - sizeof(sMDH);
-        //Is VB magic? For now let's assume it's not, and that this is just Siemens secret sauce.
-        siemens_dat.seekg(len, siemens_dat.cur);
-        return std::vector<ISMRMRD::Waveform>();
-    } else {
-        len = dma_length - sizeof(sScanHeader);
-
-//        siemens_dat.seekg(len,siemens_dat.cur);
-//        return std::vector<ISMRMRD::Waveform>();
-        auto cur_pos = siemens_dat.tellg();
-        uint32_t packetSize;
-        siemens_dat.read((char *) &packetSize, sizeof(uint32_t));
-        std::string packedID;
-        {
-            char packedIDArr[52];
-            siemens_dat.read(packedIDArr, 52);
-            packedID = packedIDArr;
-
-        }
-
-        if ((skip_syncdata) || (packedID.find("PMU") == packedID.npos)) { //packedID indicates this isn't PMU data, so let's jump ship.
-            siemens_dat.seekg(cur_pos);
-            siemens_dat.seekg(len, siemens_dat.cur);
-            return std::vector<ISMRMRD::Waveform>();
+/// Bounds checked sequential reads from a scan block that is already in memory
+class BlockReader {
+public:
+    BlockReader(const char *block, size_t len) : block_(block), len_(len), pos_(0) {}
 
-        }
-
-        bool learning_phase = packedID.find("PMULearnPhase") != packedID.npos;
+    void read(void *dst, size_t n) {
+        memcpy(dst, skip(n), n);
+    }
 
-        uint32_t swappedFlag, timestamp0, timestamp, packerNr, duration;
+    /// Returns the next n bytes in place
+    const char *skip(size_t n) {
+        if (n > len_ - pos_) throw std::runtime_error("Malformed file");
+        const char *p = block_ + pos_;
+        pos_ += n;
+        return p;
+    }
 
-        siemens_dat.read((char *) &swappedFlag, sizeof(uint32_t));
-        siemens_dat.read((char *) &timestamp0, sizeof(uint32_t));
-        siemens_dat.read((char *) &timestamp, sizeof(uint32_t));
-        siemens_dat.read((char *) &packerNr, sizeof(uint32_t));
-        siemens_dat.read((char *) &duration, sizeof(uint32_t));
+private:
+    const char *block_;
+    size_t len_;
+    size_t pos_;
+};
 
-        PMU_Type magic;
-        siemens_dat.read((char *) &magic, sizeof(uint32_t));
-        //Read in all the PMU data first, to figure out if we have multiple ECGs.
-        std::map<PMU_Type, std::tuple<std::vector<PMUdata>, uint32_t >> pmu_map;
-        std::set<PMU_Type> ecg_types = {PMU_Type::ECG1, PMU_Type::ECG2, PMU_Type::ECG3, PMU_Type::ECG4};
-        std::map<PMU_Type, std::tuple<std::vector<PMUdata>, uint32_t >> ecg_map;
-        while (magic != PMU_Type::END) {
-            //Read and store period
-            uint32_t period;
+// ECG1 to EXT2, numbered consecutively in the upper half of the PMU_Type values
+const size_t PMU_CHANNEL_TYPES = 8;
 
-            siemens_dat.read((char *) &period, sizeof(uint32_t));
+size_t pmuChannelIndex(PMU_Type type) {
+    return (((uint32_t) type >> 16) & 0xFF) - 1;
+}
 
-            //Allocate and read data
-            std::vector<PMUdata> data(duration / period);
-            siemens_dat.read((char *) data.data(), data.size() * sizeof(PMUdata));
-            //Split into ECG and PMU sets.
-            if (ecg_types.count(magic)) {
-                ecg_map[magic] = std::make_tuple(std::move(data), period);
-            } else {
-                pmu_map[magic] = std::make_tuple(std::move(data), period);
-            }
-            //Read next tag
-            siemens_dat.read((char *) &magic, sizeof(uint32_t));
-            if (!PMU_Types.count(magic))
-                throw std::runtime_error("Malformed file");
+PMU_Type pmuChannelType(size_t index) {
+    return (PMU_Type) ((uint32_t) PMU_Type::ECG1 + (index << 16));
+}
 
+/// PMU channel of a sync data packet, the samples are left in the packet
+struct PMUChannel {
+    const char *samples; // PMUdata, not necessarily aligned
+    size_t count;
 
-        }
+    PMUdata sample(size_t i) const {
+        PMUdata d;
+        memcpy(&d, samples + i * sizeof(PMUdata), sizeof(PMUdata));
+        return d;
+    }
+};
 
-        //Have to handle ECG separately.
+bool containsString(const char *s, size_t n, const char *needle) {
+    return std::search(s, s + n, needle, needle + strlen(needle)) != s + n;
+}
 
-        std::vector<ISMRMRD::Waveform> waveforms;
-        waveforms.reserve(5);
-        if (ecg_map.size() > 0 || pmu_map.size() > 0) {
+/// Returns waveforms[count++] sized for the given samples and channels. The waveform decoded at the same
+/// place of the previous packet is reused if it has the same size, as it does in the steady state.
+ISMRMRD::Waveform &nextWaveform(std::vector<ISMRMRD::Waveform> &waveforms, size_t &count, size_t samples,
+                                size_t channels) {
+    if (count == waveforms.size()) {
+        waveforms.emplace_back(samples, channels);
+        countAllocation(); // The samples are allocated by the ISMRMRD C API
+    } else if (waveforms[count].head.number_of_samples != samples || waveforms[count].head.channels != channels) {
+        waveforms[count] = ISMRMRD::Waveform(samples, channels);
+        countAllocation();
+    }
+    return waveforms[count++];
+}
 
-            if (ecg_map.size() > 0) {
+const char *readSyncdata(std::istream &siemens_dat, bool VBFILE, uint32_t dma_length, bool skip_syncdata,
+                         std::vector<char> &scan_buffer, size_t &len, bool persistent) {
+    if (VBFILE) {
+        //Is VB magic? For now let's assume it's not, and that this is just Siemens secret sauce.
+        siemens_dat.seekg(dma_length - sizeof(sMDH), siemens_dat.cur);
+        len = 0;
+        return nullptr;
+    }
 
-                size_t channels = ecg_map.size();
-                size_t number_of_elements = std::get<0>(ecg_map.begin()->second).size();
+    if (skip_syncdata) {
+        siemens_dat.seekg(dma_length - sizeof(sScanHeader), siemens_dat.cur);
+        len = 0;
+        return nullptr;
+    }
 
-                auto ecg_waveform = ISMRMRD::Waveform(number_of_elements, channels + 1);
-                ecg_waveform.head.waveform_id = waveformId.at(PMU_Type::ECG1) + 5 * learning_phase;
+    //Read the whole sync data packet at once, it is decoded from memory
+    len = dma_length - sizeof(sScanHeader);
+    const char *block = readBlock(siemens_dat, len, scan_buffer, persistent);
+    if (!siemens_dat) {
+        len = 0;
+        return nullptr;
+    }
+    return block;
+}
 
-                uint32_t *ecg_waveform_data = ecg_waveform.data;
+size_t decodeSyncdata(const char *block, size_t len, const sScanHeader &scanheader, long last_scan_counter,
+                      std::vector<ISMRMRD::Waveform> &waveforms) {
+    BlockReader sync_data(block, len);
+    uint32_t packetSize;
+    sync_data.read(&packetSize, sizeof(uint32_t));
+    const char *packedID = sync_data.skip(52);
+    size_t packedID_length = strnlen(packedID, 52);
 
-                uint32_t *trigger_data = ecg_waveform_data + number_of_elements * channels;
-                std::fill(trigger_data, trigger_data + number_of_elements, 0);
-                //Copy in the data
-                for (auto key_val : ecg_map) {
-                    auto tup = unpack_pmu(std::get<0>(key_val.second));
-                    auto &data = std::get<0>(tup);
-                    auto &trigger = std::get<1>(tup);
+    if (!containsString(packedID, packedID_length, "PMU")) { //packedID indicates this isn't PMU data, so let's jump ship.
+        return 0;
 
-                    std::copy(data.begin(), data.end(), ecg_waveform_data);
-                    ecg_waveform_data += data.size();
+    }
 
-                    for (auto i = 0; i < number_of_elements; i++) trigger_data[i] |= trigger[i];
+    bool learning_phase = containsString(packedID, packedID_length, "PMULearnPhase");
 
-                }
+    uint32_t swappedFlag, timestamp0, timestamp, packerNr, duration;
 
-//                ecg_waveform.head.sample_time_us = sample_time_us.at(PMU_Type::ECG1);
-                waveforms.push_back(std::move(ecg_waveform));
+    sync_data.read(&swappedFlag, sizeof(uint32_t));
+    sync_data.read(&timestamp0, sizeof(uint32_t));
+    sync_data.read(&timestamp, sizeof(uint32_t));
+    sync_data.read(&packerNr, sizeof(uint32_t));
+    sync_data.read(&duration, sizeof(uint32_t));
 
+    PMU_Type magic;
+    sync_data.read(&magic, sizeof(uint32_t));
+    //Find all the PMU data first, to figure out if we have multiple ECGs.
+    //The samples are decoded straight out of the block, channels are kept in PMU_Type order.
+    PMUChannel channels[PMU_CHANNEL_TYPES] = {};
+    while (magic != PMU_Type::END) {
+        if (!PMU_Types.count(magic))
+            throw std::runtime_error("Malformed file");
 
-            }
+        //Read and store period
+        uint32_t period;
 
+        sync_data.read(&period, sizeof(uint32_t));
 
-            for (auto key_val : pmu_map) {
-                auto tup = unpack_pmu(std::get<0>(key_val.second));
-                auto &data = std::get<0>(tup);
-                auto &trigger = std::get<1>(tup);
+        PMUChannel &channel = channels[pmuChannelIndex(magic)];
+        channel.count = duration / period;
+        channel.samples = sync_data.skip(channel.count * sizeof(PMUdata));
+        //Read next tag
+        sync_data.read(&magic, sizeof(uint32_t));
+    }
 
-                auto waveform = ISMRMRD::Waveform(data.size(), 2);
-                waveform.head.waveform_id = waveformId.at(key_val.first) + 5 * learning_phase;
-                std::copy(data.begin(), data.end(), waveform.data);
+    //Have to handle ECG separately.
 
-                std::copy(trigger.begin(), trigger.end(), waveform.data + data.size());
+    size_t count = 0;
+    size_t ecg_channels = 0;
+    const PMUChannel *first_ecg = nullptr;
+    for (size_t i = pmuChannelIndex(PMU_Type::ECG1); i <= pmuChannelIndex(PMU_Type::ECG4); i++) {
+        if (!channels[i].samples) continue;
+        if (!first_ecg) first_ecg = &channels[i];
+        ecg_channels++;
+    }
 
-//                waveform.head.sample_time_us = sample_time_us.at(key_val.first);
-                waveforms.push_back(std::move(waveform));
+    if (ecg_channels > 0) {
+        size_t number_of_elements = first_ecg->count;
+
+        ISMRMRD::Waveform &ecg_waveform = nextWaveform(waveforms, count, number_of_elements, ecg_channels + 1);
+        ecg_waveform.head.waveform_id = waveformId.at(PMU_Type::ECG1) + 5 * learning_phase;
+
+        uint32_t *ecg_waveform_data = ecg_waveform.data;
+
+        uint32_t *trigger_data = ecg_waveform_data + number_of_elements * ecg_channels;
+        std::fill(trigger_data, trigger_data + number_of_elements, 0);
+        //Copy in the data
+        for (size_t i = pmuChannelIndex(PMU_Type::ECG1); i <= pmuChannelIndex(PMU_Type::ECG4); i++) {
+            const PMUChannel &channel = channels[i];
+            if (!channel.samples) continue;
+            size_t samples = std::min(channel.count, number_of_elements);
+            for (size_t s = 0; s < samples; s++) {
+                PMUdata d = channel.sample(s);
+                ecg_waveform_data[s] = d.data;
+                trigger_data[s] |= d.trigger;
             }
-            //Figure out number of ECG channels
-
-
+            ecg_waveform_data += samples;
         }
 
+//                ecg_waveform.head.sample_time_us = sample_time_us.at(PMU_Type::ECG1);
+    }
 
-        for (auto &waveform : waveforms) {
-            waveform.head.time_stamp = timestamp;
-            waveform.head.measurement_uid = scanheader.lMeasUID;
-            waveform.head.scan_counter = last_scan_counter;
-            waveform.head.sample_time_us = double(duration * 100) / waveform.head.number_of_samples;
-        }
+    for (size_t i = pmuChannelIndex(PMU_Type::PULS); i < PMU_CHANNEL_TYPES; i++) {
+        const PMUChannel &channel = channels[i];
+        if (!channel.samples) continue;
 
-        if (waveforms.size()) makeWaveformHeader(header); //Add the header if needed
+        ISMRMRD::Waveform &waveform = nextWaveform(waveforms, count, channel.count, 2);
+        waveform.head.waveform_id = waveformId.at(pmuChannelType(i)) + 5 * learning_phase;
+        for (size_t s = 0; s < channel.count; s++) {
+            PMUdata d = channel.sample(s);
+            waveform.data[s] = d.data;
+            waveform.data[channel.count + s] = d.trigger;
+        }
 
-        siemens_dat.seekg(cur_pos);
-        siemens_dat.seekg(len, siemens_dat.cur);
-        return waveforms;
+//                waveform.head.sample_time_us = sample_time_us.at(key_val.first);
+    }
 
 
+    for (size_t i = 0; i < count; i++) {
+        ISMRMRD::Waveform &waveform = waveforms[i];
+        waveform.head.time_stamp = timestamp;
+        waveform.head.measurement_uid = scanheader.lMeasUID;
+        waveform.head.scan_counter = last_scan_counter;
+        waveform.head.sample_time_us = double(duration * 100) / waveform.head.number_of_samples;
     }
+
+    return count;
 }
 
 //
-//void getsyncData(std::ifstream &siemens_dat, bool VBFILE, uint32_t dma_length) {
+//void getsyncData(std::istream &siemens_dat, bool VBFILE, uint32_t dma_length) {
 //    size_t len = 0;
 //    if (VBFILE)
 //             {
@@ -2049,7 +2542,7 @@ std::string readXmlConfig(bool debug_xml, const std::string &parammap_file_conte
     throw std::runtime_error("No Meas buffer found in Siemens dataset");
 }
 
-std::vector<MeasurementHeaderBuffer> readMeasurementHeaderBuffers(std::ifstream &siemens_dat, uint32_t num_buffers) {
+std::vector<MeasurementHeaderBuffer> readMeasurementHeaderBuffers(std::istream &siemens_dat, uint32_t num_buffers) {
     auto buffers = std::vector<MeasurementHeaderBuffer>(num_buffers);
 
     std::cout << "Number of parameter buffers: " << num_buffers << std::endl;
@@ -2072,7 +2565,7 @@ std::vector<MeasurementHeaderBuffer> readMeasurementHeaderBuffers(std::ifstream
 }
 
 std::vector<MrParcRaidFileEntry>
-readParcFileEntries(std::ifstream &siemens_dat, const MrParcRaidFileHeader &ParcRaidHead, bool VBFILE) {
+readParcFileEntries(std::istream &siemens_dat, const MrParcRaidFileHeader &ParcRaidHead, bool VBFILE) {
     std::vector<MrParcRaidFileEntry> ParcFileEntries(64);
 
     if (VBFILE) {
@@ -2083,8 +2576,13 @@ readParcFileEntries(std::ifstream &siemens_dat, const MrParcRaidFileHeader &Parc
         }
 
         ParcFileEntries[0].off_ = 0;
-        siemens_dat.seekg(0, std::ios_base::end); //Rewind a bit, we have no raid file header.
-        ParcFileEntries[0].len_ = siemens_dat.tellg(); //This is the whole size of the dat file
+        if (siemens_dat.seekg(0, std::ios_base::end)) {
+            ParcFileEntries[0].len_ = siemens_dat.tellg(); //This is the whole size of the dat file
+        } else {
+            // Streamed or growing input, the measurement ends at ACQEND
+            siemens_dat.clear();
+            ParcFileEntries[0].len_ = UNKNOWN_MEASUREMENT_LENGTH;
+        }
         siemens_dat.seekg(0, std::ios_base::beg); //Rewind a bit, we have no raid file header.
 
         std::cout << "Protocol name: " << ParcFileEntries[0].protName_ << std::endl; // blank
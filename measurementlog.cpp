@@ -0,0 +1,70 @@
+#include "measurementlog.h"
+
+#include <iostream>
+
+MeasurementLog::MeasurementLog() : out_(*this, std::cout), err_(*this, std::cerr) {
+}
+
+MeasurementLog::Scope::Scope(MeasurementLog &log, unsigned int measurement) : log_(log) {
+    std::lock_guard<std::mutex> lock(log_.mutex_);
+    log_.measurements_[std::this_thread::get_id()] = measurement;
+}
+
+MeasurementLog::Scope::~Scope() {
+    std::lock_guard<std::mutex> lock(log_.mutex_);
+    log_.out_.finishLine(std::this_thread::get_id());
+    log_.err_.finishLine(std::this_thread::get_id());
+    log_.measurements_.erase(std::this_thread::get_id());
+}
+
+MeasurementLog::PrefixBuf::PrefixBuf(MeasurementLog &log, std::ostream &stream)
+    : log_(log), stream_(stream), original_(stream.rdbuf(this)) {
+}
+
+MeasurementLog::PrefixBuf::~PrefixBuf() {
+    stream_.rdbuf(original_);
+}
+
+void MeasurementLog::PrefixBuf::finishLine(std::thread::id thread) {
+    auto line = lines_.find(thread);
+    if (line == lines_.end()) return;
+    if (!line->second.empty()) {
+        writeLine(log_.measurements_[thread], line->second + '\n');
+        original_->pubsync();
+    }
+    lines_.erase(line);
+}
+
+MeasurementLog::PrefixBuf::int_type MeasurementLog::PrefixBuf::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+}
+
+std::streamsize MeasurementLog::PrefixBuf::xsputn(const char *s, std::streamsize n) {
+    std::lock_guard<std::mutex> lock(log_.mutex_);
+    auto measurement = log_.measurements_.find(std::this_thread::get_id());
+    if (measurement == log_.measurements_.end()) return original_->sputn(s, n);
+
+    std::string &line = lines_[measurement->first];
+    for (std::streamsize i = 0; i < n; i++) {
+        line += s[i];
+        if (s[i] == '\n') {
+            writeLine(measurement->second, line);
+            line.clear();
+        }
+    }
+    return n;
+}
+
+int MeasurementLog::PrefixBuf::sync() {
+    // Unfinished lines are held back until they are complete, only whole lines are flushed
+    std::lock_guard<std::mutex> lock(log_.mutex_);
+    return original_->pubsync();
+}
+
+void MeasurementLog::PrefixBuf::writeLine(unsigned int measurement, const std::string &line) {
+    std::string prefix = "[meas " + std::to_string(measurement) + "] ";
+    original_->sputn(prefix.data(), prefix.size());
+    original_->sputn(line.data(), line.size());
+}
@@ -0,0 +1,67 @@
+#ifndef MEASUREMENTLOG_H_
+#define MEASUREMENTLOG_H_
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+/// Keeps the messages of measurements converted concurrently apart. While it exists, std::cout and
+/// std::cerr go through it: lines written by a thread inside a Scope are prefixed with the scope's
+/// measurement number and printed whole, one line at a time, so lines of different measurements do
+/// not interleave mid-line. Other threads write through unchanged. The streams are restored when the
+/// log is destroyed.
+class MeasurementLog {
+public:
+    MeasurementLog();
+
+    MeasurementLog(const MeasurementLog &) = delete;
+    MeasurementLog &operator=(const MeasurementLog &) = delete;
+
+    /// Tags the lines the calling thread writes with the measurement number while it exists.
+    /// A line left unfinished is completed when the scope ends.
+    class Scope {
+    public:
+        Scope(MeasurementLog &log, unsigned int measurement);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        MeasurementLog &log_;
+    };
+
+private:
+    /// Replaces the buffer of one stream, collecting each tagged thread's line until it is complete
+    class PrefixBuf : public std::streambuf {
+    public:
+        PrefixBuf(MeasurementLog &log, std::ostream &stream);
+        ~PrefixBuf() override;
+
+        /// Writes the unfinished line of the thread, called with the log's mutex held
+        void finishLine(std::thread::id thread);
+
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char *s, std::streamsize n) override;
+        int sync() override;
+
+    private:
+        void writeLine(unsigned int measurement, const std::string &line);
+
+        MeasurementLog &log_;
+        std::ostream &stream_;
+        std::streambuf *original_;
+        std::map<std::thread::id, std::string> lines_; // Unfinished line of every tagged thread
+    };
+
+    std::mutex mutex_;
+    std::map<std::thread::id, unsigned int> measurements_; // Threads inside a Scope
+    PrefixBuf out_;
+    PrefixBuf err_;
+};
+
+#endif //MEASUREMENTLOG_H_
@@ -0,0 +1,558 @@
+#include "mrdoutput.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// The written output is dropped from the page cache in steps of this size
+const size_t PAGE_CACHE_DROP_STEP = 64 << 20;
+
+// Records per chunk of the datasets written in SWMR mode
+const size_t SWMR_CHUNK_RECORDS = 256;
+
+// Memory of an in-memory file grows in steps of this size
+const size_t CORE_DRIVER_INCREMENT = 16 << 20;
+
+}
+
+// Records in the layout of the ISMRMRD compound types, the samples are variable length arrays.
+// The headers are stored as they are in memory, their HDF5 type is taken from the dataset.
+
+struct Hdf5Output::AcquisitionRecord {
+    ISMRMRD::AcquisitionHeader head;
+    hvl_t traj;
+    hvl_t data; // Complex samples as pairs of floats
+
+    static hid_t createType(hid_t head_type) {
+        hid_t type = H5Tcreate(H5T_COMPOUND, sizeof(AcquisitionRecord));
+        hid_t floats = H5Tvlen_create(H5T_NATIVE_FLOAT);
+        H5Tinsert(type, "head", HOFFSET(AcquisitionRecord, head), head_type);
+        H5Tinsert(type, "traj", HOFFSET(AcquisitionRecord, traj), floats);
+        H5Tinsert(type, "data", HOFFSET(AcquisitionRecord, data), floats);
+        H5Tclose(floats);
+        return type;
+    }
+
+    void setPointers(char *samples, const size_t *&offsets) {
+        traj.p = samples + *offsets++;
+        data.p = samples + *offsets++;
+    }
+};
+
+struct Hdf5Output::WaveformRecord {
+    decltype(ISMRMRD::Waveform::head) head;
+    hvl_t data;
+
+    static hid_t createType(hid_t head_type) {
+        hid_t type = H5Tcreate(H5T_COMPOUND, sizeof(WaveformRecord));
+        hid_t samples = H5Tvlen_create(H5T_NATIVE_UINT32);
+        H5Tinsert(type, "head", HOFFSET(WaveformRecord, head), head_type);
+        H5Tinsert(type, "data", HOFFSET(WaveformRecord, data), samples);
+        H5Tclose(samples);
+        return type;
+    }
+
+    void setPointers(char *samples, const size_t *&offsets) {
+        data.p = samples + *offsets++;
+    }
+};
+
+/// Records of one dataset of the group waiting to be written. The buffers are kept from batch to batch.
+template <typename Record>
+struct Hdf5Output::Batch {
+    explicit Batch(const std::string &path) : path(path), dataset(-1), type(-1), size(0), extent(0), reserved(0) {}
+
+    ~Batch() {
+        if (type >= 0) H5Tclose(type);
+        if (dataset >= 0) H5Dclose(dataset);
+    }
+
+    Record &add() {
+        records.emplace_back();
+        return records.back();
+    }
+
+    void addSamples(const void *p, size_t bytes) {
+        offsets.push_back(samples.size());
+        samples.insert(samples.end(), static_cast<const char *>(p), static_cast<const char *>(p) + bytes);
+    }
+
+    /// Opens the dataset ISMRMRD has created. Returns false if its records do not match Record.
+    /// With replace, a dataset holding just the placeholder record ISMRMRD created it with is replaced by an
+    /// empty one with the same record type, chunk_records records per chunk (or the chunks ISMRMRD chose).
+    /// HDF5 does not reuse the space of that record, a few hundred bytes. Records of an earlier run are
+    /// kept as they are.
+    bool open(hid_t file, bool replace = false, hsize_t chunk_records = 0) {
+        dataset = H5Dopen2(file, path.c_str(), H5P_DEFAULT);
+        if (dataset < 0) return false;
+
+        hid_t space = H5Dget_space(dataset);
+        bool one_dimensional = H5Sget_simple_extent_ndims(space) == 1;
+        if (one_dimensional) H5Sget_simple_extent_dims(space, &size, nullptr);
+        H5Sclose(space);
+
+        hid_t file_type = H5Dget_type(dataset);
+        int head = H5Tget_member_index(file_type, "head");
+        hid_t head_type = head >= 0 ? H5Tget_member_type(file_type, head) : -1;
+        if (one_dimensional && head_type >= 0 && H5Tget_size(head_type) == sizeof(Record::head)) {
+            type = Record::createType(head_type);
+        }
+        if (head_type >= 0) H5Tclose(head_type);
+
+        if (type >= 0 && replace && size == 1) {
+            hid_t dcpl;
+            if (chunk_records > 0) {
+                dcpl = H5Pcreate(H5P_DATASET_CREATE);
+                if (dcpl < 0 || H5Pset_chunk(dcpl, 1, &chunk_records) < 0) {
+                    if (dcpl >= 0) H5Pclose(dcpl);
+                    H5Tclose(file_type);
+                    throw std::runtime_error("Failed to set up the chunk size of " + path);
+                }
+            } else {
+                dcpl = H5Dget_create_plist(dataset);
+            }
+            H5Dclose(dataset);
+            H5Ldelete(file, path.c_str(), H5P_DEFAULT);
+
+            hsize_t empty = 0;
+            hsize_t unlimited = H5S_UNLIMITED;
+            space = H5Screate_simple(1, &empty, &unlimited);
+            dataset = H5Dcreate2(file, path.c_str(), file_type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+            H5Pclose(dcpl);
+            H5Sclose(space);
+            size = 0;
+            if (dataset < 0) {
+                H5Tclose(file_type);
+                throw std::runtime_error("Failed to create " + path);
+            }
+        }
+        H5Tclose(file_type);
+        extent = size;
+        return type >= 0;
+    }
+
+    /// Shrinks a dataset grown to the reserved size to the records written
+    void trim() {
+        if (dataset < 0 || extent == size) return;
+        if (H5Dset_extent(dataset, &size) < 0) throw std::runtime_error("Failed to resize " + path);
+        extent = size;
+    }
+
+    std::string path;            // Dataset in the file
+    std::vector<Record> records;
+    std::vector<char> samples;   // Samples of all records, back to back
+    std::vector<size_t> offsets; // Start of every variable length array in samples, in record order
+    hid_t dataset;               // Opened once ISMRMRD has created the dataset
+    hid_t type;                  // Memory type of Record
+    hsize_t size;                // Records in the dataset
+    hsize_t extent;              // Records the dataset has room for, more than size once reserved
+    hsize_t reserved;            // Expected records, the dataset is grown to this many at once
+};
+
+std::mutex &Hdf5Output::hdf5Mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+Hdf5Output::Hdf5Output(const std::string &filename, const std::string &group, bool drop_cache,
+                       size_t batch_records, size_t batch_bytes, bool swmr,
+                       unsigned int swmr_flush_ms, uint64_t memory_limit)
+    : filename_(filename), group_(group), batch_records_(batch_records), batch_bytes_(batch_bytes),
+      chunk_records_(0), file_(-1), cache_fd_(-1), unflushed_bytes_(0), preallocated_(false), swmr_(swmr),
+      swmr_started_(false), swmr_flush_interval_(swmr_flush_ms), in_memory_(false),
+      memory_limit_(filename == "-" ? 0 : memory_limit) {
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    namespace fs = boost::filesystem;
+    // The image replaces the whole file, an existing file gets the measurement added on disk as usual
+    boost::system::error_code exists_error;
+    if (memory_limit > 0 && filename != "-" && fs::exists(filename, exists_error)) {
+        std::cout << filename << " exists already, adding the measurement on disk rather than in memory"
+                  << std::endl;
+        memory_limit = 0;
+        memory_limit_ = 0;
+    }
+    if (memory_limit > 0 || filename == "-") {
+        // ISMRMRD sets up the group, the header and both datasets in a scratch file, which is read into
+        // memory and completed there. Nothing is written to the destination before the file is closed.
+        fs::path scratch = fs::temp_directory_path() / fs::unique_path("siemens_to_ismrmrd-%%%%-%%%%-%%%%.h5");
+        {
+            ISMRMRD::Dataset setup(scratch.string().c_str(), group.c_str(), true);
+            setup.writeHeader("");
+            setup.appendAcquisition(ISMRMRD::Acquisition());
+            setup.appendWaveform(ISMRMRD::Waveform());
+        }
+        hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+        H5Pset_fapl_core(fapl, CORE_DRIVER_INCREMENT, 0);
+        file_ = H5Fopen(scratch.string().c_str(), H5F_ACC_RDWR, fapl);
+        H5Pclose(fapl);
+        boost::system::error_code ignored;
+        fs::remove(scratch, ignored);
+        if (file_ < 0) throw std::runtime_error("Failed to set up " + filename + " in memory");
+
+        in_memory_ = true;
+        acquisitions_.reset(new Batch<AcquisitionRecord>(group + "/data"));
+        waveforms_.reset(new Batch<WaveformRecord>(group + "/waveforms"));
+        replacePlaceholders();
+        return;
+    }
+    if (swmr) {
+        // SWMR needs the latest file format from the superblock on, which ISMRMRD does not create.
+        // An existing file is opened by ISMRMRD as usual and checked when SWMR writing starts.
+        hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+        H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+        H5E_BEGIN_TRY {
+            hid_t file = H5Fcreate(filename.c_str(), H5F_ACC_EXCL, H5P_DEFAULT, fapl);
+            if (file >= 0) H5Fclose(file);
+        } H5E_END_TRY;
+        H5Pclose(fapl);
+        chunk_records_ = SWMR_CHUNK_RECORDS;
+    }
+    dataset_.reset(new ISMRMRD::Dataset(filename.c_str(), group.c_str(), true));
+    if (batch_records > 1 || swmr) {
+        // The datasets ISMRMRD appends acquisitions and waveforms to
+        acquisitions_.reset(new Batch<AcquisitionRecord>(group + "/data"));
+        waveforms_.reset(new Batch<WaveformRecord>(group + "/waveforms"));
+    }
+#ifndef _WIN32
+    if (drop_cache) cache_fd_ = ::open(filename.c_str(), O_RDONLY);
+#endif
+}
+
+Hdf5Output::~Hdf5Output() {
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    try {
+        flushAll();
+        if (acquisitions_) acquisitions_->trim();
+        if (in_memory_) writeImage();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+    }
+    acquisitions_.reset();
+    waveforms_.reset();
+    if (file_ >= 0) H5Fclose(file_);
+    // Closing the dataset flushes everything HDF5 still holds
+    dataset_.reset();
+#ifdef __linux__
+    if (preallocated_) {
+        // Truncating to the current size frees the preallocated blocks HDF5 has not used
+        int fd = ::open(filename_.c_str(), O_WRONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && ftruncate(fd, st.st_size) != 0) {
+            std::cerr << "WARNING: Failed to release the space preallocated for " << filename_ << std::endl;
+        }
+        if (fd >= 0) close(fd);
+    }
+#endif
+#ifndef _WIN32
+    if (cache_fd_ >= 0) {
+        dropWrittenPages(true);
+        close(cache_fd_);
+    }
+#endif
+}
+
+void Hdf5Output::appendAcquisition(const ISMRMRD::Acquisition &acq) {
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    if (swmr_ && !swmr_started_) {
+        pending_acquisitions_.push_back(acq);
+        return;
+    }
+    addAcquisition(acq);
+    flushForReaders();
+}
+
+void Hdf5Output::appendWaveform(const ISMRMRD::Waveform &wav) {
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    if (swmr_ && !swmr_started_) {
+        pending_waveforms_.push_back(wav);
+        return;
+    }
+    addWaveform(wav);
+    flushForReaders();
+}
+
+void Hdf5Output::addAcquisition(const ISMRMRD::Acquisition &acq) {
+    if (!acquisitions_ || acquisitions_->dataset < 0) {
+        // ISMRMRD creates the dataset with the first record
+        dataset_->appendAcquisition(acq);
+        written(acq.getDataSize() + acq.getTrajSize());
+        if (acquisitions_ && !openBatch(*acquisitions_)) acquisitions_.reset();
+        return;
+    }
+
+    Batch<AcquisitionRecord> &batch = *acquisitions_;
+    AcquisitionRecord &record = batch.add();
+    record.head = acq.getHead();
+    record.traj.len = acq.getNumberOfTrajElements();
+    record.data.len = 2 * acq.getNumberOfDataElements();
+    batch.addSamples(acq.getTrajPtr(), acq.getTrajSize());
+    batch.addSamples(acq.getDataPtr(), acq.getDataSize());
+    if (batchFull(batch)) flush(batch);
+}
+
+void Hdf5Output::addWaveform(const ISMRMRD::Waveform &wav) {
+    if (!waveforms_ || waveforms_->dataset < 0) {
+        dataset_->appendWaveform(wav);
+        written(wav.size() * sizeof(uint32_t));
+        if (waveforms_ && !openBatch(*waveforms_)) waveforms_.reset();
+        return;
+    }
+
+    Batch<WaveformRecord> &batch = *waveforms_;
+    WaveformRecord &record = batch.add();
+    record.head = wav.head;
+    record.data.len = wav.size();
+    batch.addSamples(wav.data, wav.size() * sizeof(uint32_t));
+    if (batchFull(batch)) flush(batch);
+}
+
+void Hdf5Output::reserve(size_t acquisitions, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    // Reserving needs our own handle on the dataset, which batches of a single record provide
+    if (!acquisitions_) acquisitions_.reset(new Batch<AcquisitionRecord>(group_ + "/data"));
+    // SWMR readers take the dataset size as the number of records written, it only grows with them
+    if (!swmr_) acquisitions_->reserved = acquisitions;
+    // The file is only written once it is complete
+    if (in_memory_) return;
+
+#ifdef __linux__
+    // Space allocated in one go keeps the file contiguous. The file size stays as HDF5 expects it,
+    // the blocks past its end are given back when the file is closed.
+    int fd = ::open(filename_.c_str(), O_WRONLY);
+    if (fd < 0) return;
+    struct stat st;
+    preallocated_ = bytes > 0 && fstat(fd, &st) == 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, st.st_size, bytes) == 0;
+    close(fd);
+#endif
+}
+
+void Hdf5Output::beginMeasurement(const std::string &xml) {
+    if (!swmr_) return;
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    if (!swmr_started_) startSwmr(xml);
+}
+
+void Hdf5Output::writeHeader(const std::string &xml) {
+    std::lock_guard<std::mutex> lock(hdf5Mutex());
+    if (swmr_) {
+        if (!swmr_started_) startSwmr(xml);
+        if (xml != swmr_header_) {
+            std::cerr << "WARNING: The header changed after SWMR writing to " << filename_
+                      << " started, keeping the one written first" << std::endl;
+        }
+        flushAll();
+        H5Fflush(file_, H5F_SCOPE_LOCAL);
+        return;
+    }
+    flushAll();
+    if (acquisitions_) acquisitions_->trim();
+    if (dataset_) {
+        dataset_->writeHeader(xml);
+    } else {
+        rewriteHeader(xml);
+    }
+}
+
+hid_t Hdf5Output::openFile() const {
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (swmr_) H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    hid_t file = H5Fopen(filename_.c_str(), H5F_ACC_RDWR, fapl);
+    H5Pclose(fapl);
+    return file;
+}
+
+void Hdf5Output::startSwmr(const std::string &xml) {
+    dataset_->writeHeader(xml);
+    swmr_header_ = xml;
+
+    // No objects can be created once SWMR writing has started. ISMRMRD creates both datasets with a
+    // placeholder record, which is dropped when the datasets are recreated with the SWMR layout.
+    dataset_->appendAcquisition(ISMRMRD::Acquisition());
+    dataset_->appendWaveform(ISMRMRD::Waveform());
+    dataset_.reset();
+
+    file_ = openFile();
+    if (file_ < 0) throw std::runtime_error("Failed to open " + filename_ + " for SWMR writing");
+    replacePlaceholders();
+    if (H5Fstart_swmr_write(file_) < 0) {
+        throw std::runtime_error("Failed to start SWMR writing to " + filename_ +
+                                 ", the file has to be created in SWMR mode");
+    }
+    swmr_started_ = true;
+    last_swmr_flush_ = std::chrono::steady_clock::now();
+
+    for (const auto &acq : pending_acquisitions_) addAcquisition(acq);
+    for (const auto &wav : pending_waveforms_) addWaveform(wav);
+    pending_acquisitions_.clear();
+    pending_waveforms_.clear();
+}
+
+void Hdf5Output::replacePlaceholders() {
+    if (!acquisitions_->open(file_, true, chunk_records_) || !waveforms_->open(file_, true, chunk_records_)) {
+        throw std::runtime_error("Failed to open the datasets of " + group_ + " in " + filename_);
+    }
+    if (acquisitions_->size > 0 || waveforms_->size > 0) {
+        throw std::runtime_error(group_ + " in " + filename_ + " holds records already, a new group is needed");
+    }
+}
+
+void Hdf5Output::rewriteHeader(const std::string &xml) {
+    std::string path = group_ + "/xml";
+    hid_t dataset = H5Dopen2(file_, path.c_str(), H5P_DEFAULT);
+    bool ok = dataset >= 0;
+    if (ok) {
+        // The header is a variable length string, the file type works as the memory type
+        hid_t type = H5Dget_type(dataset);
+        const char *text = xml.c_str();
+        ok = H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &text) >= 0;
+        H5Tclose(type);
+        H5Dclose(dataset);
+    }
+    if (!ok) throw std::runtime_error("Failed to write the header to " + path);
+}
+
+void Hdf5Output::writeImage() {
+    H5Fflush(file_, H5F_SCOPE_LOCAL);
+    ssize_t size = H5Fget_file_image(file_, nullptr, 0);
+    std::vector<char> image(size > 0 ? size : 0);
+    if (size <= 0 || H5Fget_file_image(file_, image.data(), image.size()) != size) {
+        throw std::runtime_error("Failed to get the in-memory image of " + filename_);
+    }
+
+    bool to_stdout = filename_ == "-";
+    // Never truncates a file that appeared since the output was set up
+    FILE *out = to_stdout ? stdout : fopen(filename_.c_str(), "wbx");
+    bool ok = out && fwrite(image.data(), 1, image.size(), out) == image.size();
+    if (out) ok = (to_stdout ? fflush(out) : fclose(out)) == 0 && ok;
+    if (!ok) throw std::runtime_error("Failed to write " + (to_stdout ? std::string("stdout") : filename_));
+    in_memory_ = false;
+}
+
+void Hdf5Output::moveToDisk() {
+    writeImage();
+
+    // The datasets keep the image open until they are closed as well
+    H5Dclose(acquisitions_->dataset);
+    H5Dclose(waveforms_->dataset);
+    acquisitions_->dataset = -1;
+    waveforms_->dataset = -1;
+    H5Fclose(file_);
+
+    file_ = openFile();
+    if (file_ < 0) throw std::runtime_error("Failed to open " + filename_);
+    acquisitions_->dataset = H5Dopen2(file_, acquisitions_->path.c_str(), H5P_DEFAULT);
+    waveforms_->dataset = H5Dopen2(file_, waveforms_->path.c_str(), H5P_DEFAULT);
+    if (acquisitions_->dataset < 0 || waveforms_->dataset < 0) {
+        throw std::runtime_error("Failed to open the datasets of " + group_ + " in " + filename_);
+    }
+}
+
+void Hdf5Output::flushForReaders() {
+    if (!swmr_started_) return;
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_swmr_flush_ < swmr_flush_interval_) return;
+
+    flushAll();
+    H5Fflush(file_, H5F_SCOPE_LOCAL);
+    last_swmr_flush_ = now;
+}
+
+template <typename Record>
+bool Hdf5Output::openBatch(Batch<Record> &batch) {
+    if (file_ < 0) file_ = openFile();
+    if (file_ >= 0 && batch.open(file_)) return true;
+
+    std::cerr << "WARNING: Can not batch the writes to " << batch.path << ", writing one record at a time"
+              << std::endl;
+    return false;
+}
+
+template <typename Record>
+bool Hdf5Output::batchFull(const Batch<Record> &batch) const {
+    return batch.records.size() >= batch_records_ || (batch_bytes_ && batch.samples.size() >= batch_bytes_);
+}
+
+template <typename Record>
+void Hdf5Output::flush(Batch<Record> &batch) {
+    if (batch.records.empty()) return;
+
+    // The samples buffer may have moved while the batch was filled
+    const size_t *offsets = batch.offsets.data();
+    for (auto &record : batch.records) record.setPointers(batch.samples.data(), offsets);
+
+    hsize_t count = batch.records.size();
+    hsize_t size = batch.size + count;
+    hid_t file_space = -1;
+    hid_t memory_space = -1;
+    bool ok = true;
+    if (size > batch.extent) {
+        // Grow to the reserved size in one step rather than one batch at a time
+        hsize_t extent = std::max(size, batch.reserved);
+        ok = H5Dset_extent(batch.dataset, &extent) >= 0;
+        if (ok) batch.extent = extent;
+    }
+    if (ok) {
+        file_space = H5Dget_space(batch.dataset);
+        ok = file_space >= 0 &&
+             H5Sselect_hyperslab(file_space, H5S_SELECT_SET, &batch.size, nullptr, &count, nullptr) >= 0;
+    }
+    if (ok) {
+        memory_space = H5Screate_simple(1, &count, nullptr);
+        ok = memory_space >= 0 &&
+             H5Dwrite(batch.dataset, batch.type, memory_space, file_space, H5P_DEFAULT, batch.records.data()) >= 0;
+    }
+    if (memory_space >= 0) H5Sclose(memory_space);
+    if (file_space >= 0) H5Sclose(file_space);
+    if (!ok) throw std::runtime_error("Failed to write " + std::to_string(count) + " records to " + batch.path);
+
+    batch.size = size;
+    written(batch.samples.size());
+    batch.records.clear();
+    batch.samples.clear();
+    batch.offsets.clear();
+
+    hsize_t image_size = 0;
+    if (in_memory_ && memory_limit_ > 0 && H5Fget_filesize(file_, &image_size) >= 0 && image_size > memory_limit_) {
+        moveToDisk();
+    }
+}
+
+void Hdf5Output::flushAll() {
+    if (acquisitions_) flush(*acquisitions_);
+    if (waveforms_) flush(*waveforms_);
+}
+
+void Hdf5Output::written(size_t bytes) {
+    if (cache_fd_ < 0) return;
+    unflushed_bytes_ += bytes;
+    if (unflushed_bytes_ >= PAGE_CACHE_DROP_STEP) dropWrittenPages(false);
+}
+
+void Hdf5Output::dropWrittenPages(bool wait) {
+    unflushed_bytes_ = 0;
+#ifdef __linux__
+    // Dirty pages can not be dropped. Writing back the previous step had a whole step's time to finish,
+    // so waiting for it rarely blocks, and keeps at most two steps of the output in memory.
+    unsigned int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE;
+    if (wait) flags |= SYNC_FILE_RANGE_WAIT_AFTER;
+    sync_file_range(cache_fd_, 0, 0, flags);
+#elif !defined(_WIN32)
+    if (wait) fsync(cache_fd_);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(cache_fd_, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,142 @@
+#ifndef MRDOUTPUT_H_
+#define MRDOUTPUT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <hdf5.h>
+
+#include "ismrmrd/ismrmrd.h"
+#include "ismrmrd/dataset.h"
+
+/// Destination of a converted measurement
+class MrdOutput {
+public:
+    virtual ~MrdOutput() {}
+
+    virtual void appendAcquisition(const ISMRMRD::Acquisition &acq) = 0;
+    virtual void appendWaveform(const ISMRMRD::Waveform &wav) = 0;
+
+    /// Expected number of acquisitions and bytes of output, known from a walk over the scan headers.
+    /// Lets the output allocate its storage up front, called before the first record if at all.
+    virtual void reserve(size_t /*acquisitions*/, uint64_t /*bytes*/) {}
+
+    /// Called with the header as soon as it is known, before the first acquisition. Sync data
+    /// preceding the first acquisition may have been appended already.
+    virtual void beginMeasurement(const std::string & /*xml*/) {}
+
+    /// Called once all scans are written
+    virtual void writeHeader(const std::string &xml) = 0;
+};
+
+/// ISMRMRD HDF5 dataset in the given file and group.
+/// libhdf5 is not thread safe, so every HDF5 call of every open Hdf5Output goes through one
+/// process wide lock. This allows measurements converted in parallel to write their own files,
+/// or their own groups of the same file, without further coordination.
+class Hdf5Output : public MrdOutput {
+public:
+    /// With drop_cache the written part of the file is pushed to disk and dropped from the page cache
+    /// every 64 MiB of samples and when the file is closed.
+    /// Acquisitions and waveforms are buffered and written batch_records at a time, or as soon as their
+    /// samples reach batch_bytes, with a single HDF5 write per batch. The datasets are the same as with
+    /// one ISMRMRD append per record, batch_records = 1 writes every record right away.
+    /// With swmr the file is written in HDF5 single writer / multiple reader mode, see beginMeasurement.
+    /// With memory_limit set the file is built in memory with the HDF5 core driver and written with a
+    /// single write when it is closed. Once it grows past memory_limit bytes it is written out and
+    /// completed on disk. The filename "-" builds the file in memory regardless of the limit and writes
+    /// it to stdout.
+    Hdf5Output(const std::string &filename, const std::string &group, bool drop_cache = false,
+               size_t batch_records = 1, size_t batch_bytes = 0, bool swmr = false, unsigned int swmr_flush_ms = 1000, uint64_t memory_limit = 0);
+    ~Hdf5Output() override;
+
+    void appendAcquisition(const ISMRMRD::Acquisition &acq) override;
+    void appendWaveform(const ISMRMRD::Waveform &wav) override;
+    /// Sizes the acquisition dataset for all acquisitions at once and preallocates the file space where the
+    /// file system supports it. The dataset is shrunk to the acquisitions actually written when it is closed.
+    void reserve(size_t acquisitions, uint64_t bytes) override;
+    /// In SWMR mode writes the header, creates the datasets and starts SWMR writing. From then on the
+    /// records are flushed for readers every swmr_flush_ms, and the header can not change anymore.
+    void beginMeasurement(const std::string &xml) override;
+    void writeHeader(const std::string &xml) override;
+
+    /// Lock held around all HDF5 calls
+    static std::mutex &hdf5Mutex();
+
+private:
+    struct AcquisitionRecord;
+    struct WaveformRecord;
+    template <typename Record>
+    struct Batch;
+
+    void addAcquisition(const ISMRMRD::Acquisition &acq);
+    void addWaveform(const ISMRMRD::Waveform &wav);
+
+    /// Opens our own handle on the file, with the latest file format in SWMR mode
+    hid_t openFile() const;
+
+    /// Opens the datasets ISMRMRD has created with a placeholder record each, replacing them with empty ones
+    void replacePlaceholders();
+
+    /// Writes the header into the xml dataset ISMRMRD has created
+    void rewriteHeader(const std::string &xml);
+
+    /// Writes the file built in memory to its destination
+    void writeImage();
+
+    /// Writes the file built in memory out and continues on disk
+    void moveToDisk();
+
+    /// Writes the header through ISMRMRD, hands the file over to our own handle and starts SWMR writing
+    void startSwmr(const std::string &xml);
+
+    /// Makes the records written so far visible to SWMR readers once the flush interval has passed
+    void flushForReaders();
+
+    /// Opens the dataset ISMRMRD has created with the first record, returns false if it can not be batched
+    template <typename Record>
+    bool openBatch(Batch<Record> &batch);
+
+    template <typename Record>
+    bool batchFull(const Batch<Record> &batch) const;
+
+    /// Writes the buffered records with one HDF5 write
+    template <typename Record>
+    void flush(Batch<Record> &batch);
+
+    void flushAll();
+
+    /// Counts written samples for the page cache dropping
+    void written(size_t bytes);
+
+    /// Waits for the pages handed to the disk last time, drops them and starts writing the new ones
+    void dropWrittenPages(bool wait);
+
+    std::unique_ptr<ISMRMRD::Dataset> dataset_;
+    std::string filename_;
+    std::string group_;
+    size_t batch_records_;
+    size_t batch_bytes_;
+    hsize_t chunk_records_; // Records per chunk of the datasets replacing the placeholders, 0 keeps ISMRMRD's
+    hid_t file_; // Our own handle on the file for the batched writes, -1 until the first one
+    std::unique_ptr<Batch<AcquisitionRecord>> acquisitions_;
+    std::unique_ptr<Batch<WaveformRecord>> waveforms_;
+    int cache_fd_;          // Descriptor for the page cache advice, -1 without drop_cache
+    size_t unflushed_bytes_; // Samples appended since the last dropWrittenPages
+    bool preallocated_;      // File space past the end of the file was allocated by reserve
+    bool swmr_;
+    bool swmr_started_;
+    std::chrono::milliseconds swmr_flush_interval_;
+    std::chrono::steady_clock::time_point last_swmr_flush_;
+    std::string swmr_header_;
+    // Records appended in SWMR mode before the header, written once SWMR writing has started
+    std::vector<ISMRMRD::Acquisition> pending_acquisitions_;
+    std::vector<ISMRMRD::Waveform> pending_waveforms_;
+    bool in_memory_;        // file_ is a core driver image, nothing is on disk yet
+    uint64_t memory_limit_; // Size at which the image is moved to disk, 0 keeps it in memory
+};
+
+#endif //MRDOUTPUT_H_
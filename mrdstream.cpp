@@ -0,0 +1,403 @@
+#include "mrdstream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Length of the configuration name in a config file message
+const size_t CONFIG_FILE_LENGTH = 1024;
+
+FILE *openStream(const std::string &filename) {
+    if (filename == "-") return stdout;
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file) throw std::runtime_error("Failed to open " + filename);
+    // The messages are buffered by StreamOutput already
+    setvbuf(file, nullptr, _IONBF, 0);
+    return file;
+}
+
+#ifndef _WIN32
+/// Connects a TCP socket to host:port or [host]:port
+int connectTo(const std::string &address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+        throw std::runtime_error("Expected host:port as server address, got " + address);
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (status != 0) throw std::runtime_error("Failed to resolve " + address + ": " + gai_strerror(status));
+
+    int fd = -1;
+    int error = 0;
+    for (addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            error = errno;
+        } else if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            error = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) throw std::runtime_error("Failed to connect to " + address + ": " + strerror(error));
+
+    // Messages are batched into large buffers already, the close message should not wait for more
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+#endif
+
+}
+
+StreamOutput::StreamOutput(const std::string &filename, const std::string &config, size_t buffer_size,
+                           unsigned int flush_ms)
+    : StreamOutput(openStream(filename), filename == "-" ? "stdout" : filename, config, buffer_size, flush_ms) {
+}
+
+StreamOutput::StreamOutput(FILE *file, const std::string &name, const std::string &config, size_t buffer_size,
+                           unsigned int flush_ms)
+    : name_(name)
+    , file_(file)
+    , config_(config)
+    , buffer_(buffer_size)
+    , buffered_(0)
+    , flush_interval_(flush_ms)
+    , started_(false)
+    , closed_(false) {
+    if (config_.size() >= CONFIG_FILE_LENGTH) {
+        if (file_ && file_ != stdout) fclose(file_);
+        throw std::runtime_error("Configuration name too long: " + config_);
+    }
+}
+
+StreamOutput::~StreamOutput() {
+    // Without the close message the consumer sees the stream end early, as it should if the conversion failed
+    try {
+        if (file_) flush();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+    }
+    if (file_ && file_ != stdout) fclose(file_);
+}
+
+void StreamOutput::send(const char *data, size_t n) {
+    if (fwrite(data, 1, n, file_) != n || fflush(file_) != 0) {
+        throw std::runtime_error("Failed to write to " + name_);
+    }
+}
+
+void StreamOutput::flush() {
+    if (buffered_ == 0) return;
+    size_t n = buffered_;
+    buffered_ = 0;
+    send(buffer_.data(), n);
+}
+
+void StreamOutput::put(const void *data, size_t n) {
+    if (n == 0) return;
+    if (buffered_ == 0) oldest_ = std::chrono::steady_clock::now();
+    if (buffered_ + n > buffer_.size()) {
+        flush();
+        if (n >= buffer_.size()) {
+            // Larger than the buffer, no point in copying it
+            send(static_cast<const char *>(data), n);
+            return;
+        }
+        oldest_ = std::chrono::steady_clock::now();
+    }
+    memcpy(buffer_.data() + buffered_, data, n);
+    buffered_ += n;
+}
+
+void StreamOutput::flushIfDue() {
+    if (buffered_ > 0 && std::chrono::steady_clock::now() - oldest_ >= flush_interval_) flush();
+}
+
+void StreamOutput::startMessages(const std::string &xml) {
+    if (!config_.empty()) {
+        char name[CONFIG_FILE_LENGTH] = {};
+        memcpy(name, config_.data(), config_.size());
+        putId(MRD_MESSAGE_CONFIG_FILE);
+        put(name, sizeof(name));
+    }
+    uint32_t length = xml.size();
+    putId(MRD_MESSAGE_HEADER);
+    put(&length, sizeof(length));
+    put(xml.data(), xml.size());
+    header_ = xml;
+    started_ = true;
+
+    for (const auto &wav : pending_waveforms_) putWaveform(wav);
+    pending_waveforms_.clear();
+    // The consumer can set up its reconstruction while the first scans are converted
+    flush();
+}
+
+void StreamOutput::beginMeasurement(const std::string &xml) {
+    if (!started_) startMessages(xml);
+}
+
+void StreamOutput::appendAcquisition(const ISMRMRD::Acquisition &acq) {
+    putId(MRD_MESSAGE_ACQUISITION);
+    put(&acq.getHead(), sizeof(ISMRMRD::AcquisitionHeader));
+    put(acq.getTrajPtr(), acq.getTrajSize());
+    put(acq.getDataPtr(), acq.getDataSize());
+    flushIfDue();
+}
+
+void StreamOutput::putWaveform(const ISMRMRD::Waveform &wav) {
+    putId(MRD_MESSAGE_WAVEFORM);
+    put(&wav.head, sizeof(wav.head));
+    put(wav.data, wav.size() * sizeof(uint32_t));
+}
+
+void StreamOutput::appendWaveform(const ISMRMRD::Waveform &wav) {
+    if (!started_) {
+        pending_waveforms_.push_back(wav);
+        return;
+    }
+    putWaveform(wav);
+    flushIfDue();
+}
+
+void StreamOutput::writeHeader(const std::string &xml) {
+    if (closed_) return;
+    if (!started_) startMessages(xml);
+    if (xml != header_) {
+        std::cerr << "WARNING: The header changed after it was streamed to " << name_
+                  << ", keeping the one written first" << std::endl;
+    }
+    putId(MRD_MESSAGE_CLOSE);
+    flush();
+    closed_ = true;
+}
+
+#ifndef _WIN32
+
+TcpStreamOutput::TcpStreamOutput(const std::string &address, const std::string &config,
+                                 const std::string &reply_file, size_t buffer_size, unsigned int flush_ms,
+                                 size_t queue_depth)
+    : StreamOutput(nullptr, address, config, buffer_size, flush_ms)
+    , socket_(connectTo(address))
+    , reply_file_(nullptr)
+    , queue_depth_(std::max<size_t>(queue_depth, 1))
+    , sending_done_(false)
+    , received_(0) {
+    if (!reply_file.empty()) {
+        reply_file_ = fopen(reply_file.c_str(), "wb");
+        if (!reply_file_) {
+            close(socket_);
+            throw std::runtime_error("Failed to open " + reply_file);
+        }
+    }
+    sender_ = std::thread(&TcpStreamOutput::sendLoop, this);
+    receiver_ = std::thread(&TcpStreamOutput::receiveLoop, this);
+}
+
+TcpStreamOutput::~TcpStreamOutput() {
+    try {
+        flush();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+    }
+    if (sender_.joinable()) finishSending();
+    // Unblocks the receiver if the server has not closed the connection
+    shutdown(socket_, SHUT_RDWR);
+    if (receiver_.joinable()) receiver_.join();
+    close(socket_);
+    if (reply_file_) fclose(reply_file_);
+}
+
+void TcpStreamOutput::checkError() {
+    if (!error_.empty()) throw std::runtime_error(error_);
+}
+
+void TcpStreamOutput::send(const char *data, size_t n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Back-pressure: wait for the connection to take a buffer
+    changed_.wait(lock, [this]() { return queue_.size() < queue_depth_ || !error_.empty(); });
+    checkError();
+    std::vector<char> buffer;
+    if (!free_.empty()) {
+        buffer = std::move(free_.back());
+        free_.pop_back();
+    }
+    buffer.assign(data, data + n);
+    queue_.push_back(std::move(buffer));
+    changed_.notify_all();
+}
+
+void TcpStreamOutput::sendLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        changed_.wait(lock, [this]() { return !queue_.empty() || sending_done_; });
+        if (queue_.empty()) return;
+        // References to deque elements stay valid while further buffers are queued
+        const std::vector<char> &buffer = queue_.front();
+        lock.unlock();
+        size_t sent = 0;
+        int error = 0;
+        while (sent < buffer.size()) {
+            ssize_t n = ::send(socket_, buffer.data() + sent, buffer.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                error = errno;
+                break;
+            }
+            sent += n;
+        }
+        lock.lock();
+        free_.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+        if (error != 0) {
+            if (error_.empty()) error_ = "Failed to send to " + name() + ": " + strerror(error);
+            queue_.clear();
+            changed_.notify_all();
+            return;
+        }
+        changed_.notify_all();
+    }
+}
+
+void TcpStreamOutput::receiveLoop() {
+    std::vector<char> buffer(64 << 10);
+    for (;;) {
+        ssize_t n = recv(socket_, buffer.data(), buffer.size(), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (reply_file_ && fwrite(buffer.data(), 1, n, reply_file_) != (size_t) n) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (error_.empty()) error_ = "Failed to write the replies of " + name();
+            changed_.notify_all();
+            break;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        received_ += n;
+    }
+}
+
+void TcpStreamOutput::finishSending() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sending_done_ = true;
+        changed_.notify_all();
+    }
+    sender_.join();
+}
+
+void TcpStreamOutput::writeHeader(const std::string &xml) {
+    StreamOutput::writeHeader(xml);
+    finishSending();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        checkError();
+    }
+    // The server sends its results and closes the connection once it has processed the close message
+    shutdown(socket_, SHUT_WR);
+    receiver_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkError();
+    std::cout << "Received " << received_ << " bytes from " << name() << std::endl;
+}
+
+#else
+
+TcpStreamOutput::TcpStreamOutput(const std::string &address, const std::string &config, const std::string &,
+                                 size_t buffer_size, unsigned int flush_ms, size_t)
+    : StreamOutput(nullptr, address, config, buffer_size, flush_ms)
+    , socket_(-1)
+    , reply_file_(nullptr)
+    , queue_depth_(0)
+    , sending_done_(false)
+    , received_(0) {
+    throw std::runtime_error("Streaming to a server is not supported on this platform");
+}
+
+TcpStreamOutput::~TcpStreamOutput() {}
+
+void TcpStreamOutput::writeHeader(const std::string &xml) { StreamOutput::writeHeader(xml); }
+
+void TcpStreamOutput::send(const char *, size_t) {}
+
+#endif
+
+ShmOutput::ShmOutput(std::shared_ptr<ShmRingWriter> ring)
+    : ring_(ring)
+    , started_(false) {
+}
+
+void ShmOutput::putHeader(const std::string &xml) {
+    char *payload = ring_->begin(ShmRecordType::HEADER, xml.size());
+    memcpy(payload, xml.data(), xml.size());
+    ring_->commit();
+    header_ = xml;
+}
+
+void ShmOutput::putWaveform(const ISMRMRD::Waveform &wav) {
+    size_t data_bytes = wav.size() * sizeof(uint32_t);
+    char *payload = ring_->begin(ShmRecordType::WAVEFORM, sizeof(wav.head) + data_bytes);
+    memcpy(payload, &wav.head, sizeof(wav.head));
+    if (data_bytes) memcpy(payload + sizeof(wav.head), wav.data, data_bytes);
+    ring_->commit();
+}
+
+void ShmOutput::beginMeasurement(const std::string &xml) {
+    if (started_) return;
+    putHeader(xml);
+    started_ = true;
+    for (const auto &wav : pending_waveforms_) putWaveform(wav);
+    pending_waveforms_.clear();
+}
+
+void ShmOutput::appendAcquisition(const ISMRMRD::Acquisition &acq) {
+    // The samples start aligned within the record, see ShmAcquisition
+    size_t traj_bytes = acq.getTrajSize();
+    size_t data_offset = ShmAcquisition::dataOffset(traj_bytes) - sizeof(ShmRecordHeader);
+    char *payload = ring_->begin(ShmRecordType::ACQUISITION, data_offset + acq.getDataSize());
+    memcpy(payload, &acq.getHead(), sizeof(ISMRMRD::AcquisitionHeader));
+    if (traj_bytes) memcpy(payload + sizeof(ISMRMRD::AcquisitionHeader), acq.getTrajPtr(), traj_bytes);
+    if (acq.getDataSize()) memcpy(payload + data_offset, acq.getDataPtr(), acq.getDataSize());
+    ring_->commit();
+}
+
+void ShmOutput::appendWaveform(const ISMRMRD::Waveform &wav) {
+    if (started_) {
+        putWaveform(wav);
+    } else {
+        pending_waveforms_.push_back(wav);
+    }
+}
+
+void ShmOutput::writeHeader(const std::string &xml) {
+    if (!started_) {
+        beginMeasurement(xml);
+    } else if (xml != header_) {
+        // Readers take the later header as an update of the measurement's header
+        putHeader(xml);
+    }
+    ring_->begin(ShmRecordType::END, 0);
+    ring_->commit();
+}
@@ -0,0 +1,160 @@
+#ifndef MRDSTREAM_H_
+#define MRDSTREAM_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mrdoutput.h"
+#include "shmring.h"
+
+/// Message ids of the ISMRMRD streaming protocol
+enum MrdMessageId : uint16_t {
+    MRD_MESSAGE_CONFIG_FILE = 1,   // Name of a reconstruction configuration, 1024 bytes zero padded
+    MRD_MESSAGE_CONFIG_TEXT = 2,
+    MRD_MESSAGE_HEADER = 3,        // uint32 length, then the XML header
+    MRD_MESSAGE_CLOSE = 4,
+    MRD_MESSAGE_ACQUISITION = 1008, // Acquisition header, trajectory, complex samples
+    MRD_MESSAGE_WAVEFORM = 1026     // Waveform header, uint32 samples
+};
+
+/// Writes a measurement as messages of the ISMRMRD streaming protocol, the format Gadgetron and the
+/// ISMRMRD stream tools read: an optional configuration message, the header, the acquisitions and
+/// waveforms in the order they are converted, and a close message. No HDF5 file is involved.
+class StreamOutput : public MrdOutput {
+public:
+    /// Writes to filename, "-" writes to stdout. With a config name the stream starts with a config
+    /// file message selecting that reconstruction.
+    /// Messages are collected and written once buffer_size bytes are buffered, or when a message is
+    /// added flush_ms after the oldest buffered one, so a consumer at the other end of a pipe sees
+    /// the scans while they are converted.
+    StreamOutput(const std::string &filename, const std::string &config = "", size_t buffer_size = 1 << 20,
+                 unsigned int flush_ms = 100);
+    ~StreamOutput() override;
+
+    StreamOutput(const StreamOutput &) = delete;
+    StreamOutput &operator=(const StreamOutput &) = delete;
+
+    void appendAcquisition(const ISMRMRD::Acquisition &acq) override;
+    void appendWaveform(const ISMRMRD::Waveform &wav) override;
+    /// Writes the header message. Waveforms appended before are held back until then, the stream
+    /// has to start with the header.
+    void beginMeasurement(const std::string &xml) override;
+    /// Writes the header if beginMeasurement has not, then the close message
+    void writeHeader(const std::string &xml) override;
+
+protected:
+    /// Writes to file, which is closed by the destructor unless it is stdout. Subclasses writing
+    /// somewhere else pass nullptr and override send, name is the destination in messages. Their
+    /// destructor has to flush what is still buffered.
+    StreamOutput(FILE *file, const std::string &name, const std::string &config, size_t buffer_size,
+                 unsigned int flush_ms);
+
+    /// Writes all n bytes to the destination or throws
+    virtual void send(const char *data, size_t n);
+
+    /// Writes the buffered messages
+    void flush();
+
+    /// Name of the destination for messages
+    const std::string &name() const { return name_; }
+
+private:
+    void put(const void *data, size_t n);
+    void putId(MrdMessageId id) { put(&id, sizeof(id)); }
+    void putWaveform(const ISMRMRD::Waveform &wav);
+    void startMessages(const std::string &xml);
+
+    /// Flushes if the oldest buffered message has waited for the flush interval
+    void flushIfDue();
+
+    std::string name_;
+    FILE *file_; // nullptr if a subclass sends the messages
+    std::string config_;
+    std::vector<char> buffer_;
+    size_t buffered_;
+    std::chrono::milliseconds flush_interval_;
+    std::chrono::steady_clock::time_point oldest_; // Time the oldest buffered message was added
+    bool started_; // The header has been written
+    bool closed_;  // The close message has been written
+    std::string header_;
+    std::vector<ISMRMRD::Waveform> pending_waveforms_; // Appended before the header
+};
+
+/// Streams a measurement to an ISMRMRD protocol server such as Gadgetron over TCP, straight from the
+/// conversion. Buffers of messages are handed to a sender thread, so the conversion continues while
+/// earlier scans are on the wire. At most queue_depth buffers are queued, once they are all taken
+/// adding messages waits for the connection: a server that falls behind slows the conversion down
+/// instead of letting the queue grow. A receiver thread reads the server's replies as they come,
+/// so the server never blocks on them.
+class TcpStreamOutput : public StreamOutput {
+public:
+    /// Connects to address, given as host:port ([host]:port for IPv6 addresses). The replies of the
+    /// server are written to reply_file as they are received, if set, and dropped otherwise.
+    TcpStreamOutput(const std::string &address, const std::string &config, const std::string &reply_file = "",
+                    size_t buffer_size = 1 << 20, unsigned int flush_ms = 100, size_t queue_depth = 4);
+    ~TcpStreamOutput() override;
+
+    /// Sends the close message and waits until the server has sent its results and closed the connection
+    void writeHeader(const std::string &xml) override;
+
+protected:
+    void send(const char *data, size_t n) override;
+
+private:
+    void sendLoop();
+    void receiveLoop();
+
+    /// Waits until the sender thread has sent everything queued and stops it
+    void finishSending();
+
+    /// Throws the error the sender or receiver thread ran into, if any. Called with mutex_ held.
+    void checkError();
+
+    int socket_;
+    FILE *reply_file_;
+    size_t queue_depth_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::vector<char>> queue_; // Buffers waiting to be sent, the front one is being sent
+    std::vector<std::vector<char>> free_;  // Sent buffers kept for reuse
+    bool sending_done_;                    // No more buffers will be queued
+    std::string error_;
+    uint64_t received_;                    // Bytes received from the server
+    std::thread sender_;
+    std::thread receiver_;
+};
+
+/// Publishes a measurement into a shared memory ring (see shmring.h), from which a reconstruction on
+/// the same node reads the records in place. Every record is copied into the ring once, straight
+/// from the conversion, and the conversion waits while the ring is full.
+class ShmOutput : public MrdOutput {
+public:
+    /// Measurements can be published into the same ring one after the other
+    explicit ShmOutput(std::shared_ptr<ShmRingWriter> ring);
+
+    void appendAcquisition(const ISMRMRD::Acquisition &acq) override;
+    void appendWaveform(const ISMRMRD::Waveform &wav) override;
+    /// Publishes the header. Waveforms appended before are held back until then.
+    void beginMeasurement(const std::string &xml) override;
+    /// Publishes the header again if it has changed since beginMeasurement, then the end of the measurement
+    void writeHeader(const std::string &xml) override;
+
+private:
+    void putHeader(const std::string &xml);
+    void putWaveform(const ISMRMRD::Waveform &wav);
+
+    std::shared_ptr<ShmRingWriter> ring_;
+    bool started_;
+    std::string header_;
+    std::vector<ISMRMRD::Waveform> pending_waveforms_; // Appended before the header
+};
+
+#endif //MRDSTREAM_H_
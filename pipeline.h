@@ -0,0 +1,171 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "ringbuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Waiting strategy for the pipeline stages: yield for a while, then sleep briefly
+class PipelineBackoff {
+public:
+    PipelineBackoff() : spins_(0) {}
+
+    void wait() {
+        if (spins_ < 64) {
+            spins_++;
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    void reset() { spins_ = 0; }
+
+private:
+    unsigned int spins_;
+};
+
+/// Reader -> converter pool -> ordered writer pipeline over a fixed set of reusable work items.
+///
+/// read is called on a single reader thread and returns false once there is nothing left to read,
+/// convert is called concurrently on the worker threads and write is called on the calling thread
+/// in exactly the order the items were read. write returns false to stop the pipeline early.
+/// At most depth items are in flight. The stages are connected by lock-free ring buffers, and the
+/// first exception thrown by any stage stops all of them and is rethrown to the caller.
+template <typename Work>
+void runPipeline(unsigned int workers, size_t depth,
+                 const std::function<bool(Work &)> &read,
+                 const std::function<void(Work &)> &convert,
+                 const std::function<bool(Work &)> &write) {
+    struct Slot {
+        uint64_t sequence;
+        Work work;
+    };
+
+    if (workers < 1) workers = 1;
+    if (depth < 2) depth = 2;
+
+    std::vector<Slot> slots(depth);
+    RingBuffer<Slot *> free_slots(depth);
+    RingBuffer<Slot *> to_convert(depth);
+    RingBuffer<Slot *> to_write(depth);
+    for (auto &slot : slots) free_slots.try_push(&slot);
+
+    std::atomic<bool> stop(false);
+    std::atomic<bool> reading_done(false);
+    std::atomic<unsigned int> workers_running(workers);
+    std::atomic<uint64_t> items_read(0);
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        stop = true;
+    };
+
+    std::thread reader([&]() {
+        try {
+            PipelineBackoff backoff;
+            uint64_t sequence = 0;
+            while (!stop) {
+                Slot *slot;
+                if (!free_slots.try_pop(slot)) {
+                    backoff.wait();
+                    continue;
+                }
+                backoff.reset();
+
+                if (!read(slot->work)) break;
+
+                slot->sequence = sequence++;
+                items_read = sequence;
+                // Can not fail, there are never more slots than ring buffer cells
+                to_convert.try_push(slot);
+            }
+        }
+        catch (...) {
+            fail();
+        }
+        reading_done = true;
+    });
+
+    std::vector<std::thread> converters;
+    for (unsigned int w = 0; w < workers; w++) {
+        converters.emplace_back([&]() {
+            try {
+                PipelineBackoff backoff;
+                while (!stop) {
+                    Slot *slot;
+                    if (to_convert.try_pop(slot)) {
+                        backoff.reset();
+                        convert(slot->work);
+                        to_write.try_push(slot);
+                    } else if (reading_done) {
+                        // Everything read before reading_done was set is visible now
+                        if (!to_convert.try_pop(slot)) break;
+                        convert(slot->work);
+                        to_write.try_push(slot);
+                    } else {
+                        backoff.wait();
+                    }
+                }
+            }
+            catch (...) {
+                fail();
+            }
+            workers_running--;
+        });
+    }
+
+    // Writer: restore the read order, slots can only be ahead by at most depth items
+    try {
+        std::vector<Slot *> pending(to_write.capacity(), nullptr);
+        const size_t mask = to_write.capacity() - 1;
+        uint64_t next = 0;
+        PipelineBackoff backoff;
+
+        while (!stop) {
+            Slot *slot = pending[next & mask];
+            if (slot && slot->sequence == next) {
+                pending[next & mask] = nullptr;
+                bool keep_going = write(slot->work);
+                free_slots.try_push(slot);
+                next++;
+                if (!keep_going) {
+                    stop = true;
+                    break;
+                }
+                backoff.reset();
+                continue;
+            }
+
+            if (to_write.try_pop(slot)) {
+                pending[slot->sequence & mask] = slot;
+                backoff.reset();
+            } else if (reading_done && workers_running == 0 && next == items_read) {
+                break;
+            } else {
+                backoff.wait();
+            }
+        }
+    }
+    catch (...) {
+        fail();
+    }
+
+    stop = true;
+    reader.join();
+    for (auto &t : converters) t.join();
+
+    if (error) std::rethrow_exception(error);
+}
+
+#endif //PIPELINE_H_
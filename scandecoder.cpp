@@ -0,0 +1,333 @@
+#include "scandecoder.h"
+
+#include <cstring>
+
+#include "alloccounter.h"
+
+namespace {
+
+/// compute noise dwell time in us for dependency and built-in noise in VD/VB lines
+double compute_noise_sample_in_us(size_t num_of_noise_samples_this_acq, bool isAdjustCoilSens, bool isAdjQuietCoilSens,
+                                  bool isVB, bool isNX)
+{
+    if(isNX)
+    {
+        return 5.0;
+    }
+    else if (isAdjustCoilSens)
+    {
+        return 5.0;
+    }
+    else if (isAdjQuietCoilSens)
+    {
+        return 4.0;
+    }
+    else if (isVB)
+    {
+        return (1e6 / num_of_noise_samples_this_acq / 130.0);
+    }
+    else
+    {
+        return (((long) (76800.0 / num_of_noise_samples_this_acq)) / 10.0);
+    }
+
+    return 5.0;
+}
+
+void decodeChannelData(const char *block, bool VBFILE, const sScanHeader &scanhead, ISMRMRD::Acquisition &ismrmrd_acq) {
+    size_t nchannels = scanhead.ushUsedChannels;
+    size_t channel_samples_length = scanhead.ushSamplesInScan * sizeof(complex_float_t);
+    char *data = reinterpret_cast<char *>(ismrmrd_acq.getDataPtr());
+
+    // The channel headers carry nothing the acquisition needs, the samples are copied from a fixed stride.
+    // In VB files every channel has a full MDH, the first one is the scan header that has already been read.
+    const size_t channel_header_length = VBFILE ? sizeof(sMDH) : sizeof(sChannelHeader);
+    const size_t stride = channel_header_length + channel_samples_length;
+    if (!VBFILE) block += channel_header_length;
+
+    for (size_t c = 0; c < nchannels; c++) {
+        memcpy(data + c * channel_samples_length, block + c * stride, channel_samples_length);
+    }
+}
+
+bool attachesTrajectory(const Trajectory &trajectory, bool attachTrajectory, const sScanHeader &scanhead) {
+    //Spiral and not noise, we will add the trajectory to the data
+    return attachTrajectory && (trajectory == Trajectory::TRAJECTORY_SPIRAL) &&
+           !(scanhead.aulEvalInfoMask[0] & (1ULL << 25));
+}
+
+ISMRMRD::Acquisition &
+resizeAcquisition(const Trajectory &trajectory, bool attachTrajectory, const std::vector<size_t> &traj_dim,
+                  const sScanHeader &scanhead, AcquisitionPool &acquisitions) {
+    // Start from a blank header, acquisitions are reused from scan to scan
+    ISMRMRD::AcquisitionHeader head;
+
+    // Set the acquisition number of samples, channels and trajectory dimensions
+    head.number_of_samples = scanhead.ushSamplesInScan;
+    head.active_channels = scanhead.ushUsedChannels;
+    if (attachesTrajectory(trajectory, attachTrajectory, scanhead)) {
+        head.trajectory_dimensions = traj_dim[0];
+    } //No trajectory otherwise
+
+    return acquisitions.acquire(head);
+}
+
+void
+getAcquisition(bool flash_pat_ref_scan, const Trajectory &trajectory, long dwell_time_0, long max_channels,
+               bool isAdjustCoilSens, bool isAdjQuietCoilSens, bool isVB, bool isNX, bool attachTrajectory, const ISMRMRD::NDArray<float> &traj,
+               const std::vector<size_t> &traj_dim, const sScanHeader &scanhead, ISMRMRD::Acquisition &ismrmrd_acq) {
+    // The number of samples, channels and trajectory dimensions have been set by resizeAcquisition
+    // and the channel data has already been read into the acquisition
+
+    // Acquisition header values are zero by default
+    ismrmrd_acq.measurement_uid() = scanhead.lMeasUID;
+    ismrmrd_acq.scan_counter() = scanhead.ulScanCounter;
+    ismrmrd_acq.acquisition_time_stamp() = scanhead.ulTimeStamp;
+    ismrmrd_acq.physiology_time_stamp()[0] = scanhead.ulPMUTimeStamp;
+    ismrmrd_acq.available_channels() = (uint16_t) max_channels;
+    // The acquisition is already sized, keep what resize() would have enforced afterwards
+    if (ismrmrd_acq.available_channels() < ismrmrd_acq.active_channels()) {
+        ismrmrd_acq.available_channels() = ismrmrd_acq.active_channels();
+    }
+    // uint64_t channel_mask[16];     //Mask to indicate which channels are active. Support for 1024 channels
+    ismrmrd_acq.discard_pre() = scanhead.sCutOff.ushPre;
+    ismrmrd_acq.discard_post() = scanhead.sCutOff.ushPost;
+    ismrmrd_acq.center_sample() = scanhead.ushKSpaceCentreColumn;
+
+    // std::cout << "isAdjustCoilSens, isVB : " << isAdjustCoilSens << " " << isVB << std::endl;
+
+    if (scanhead.aulEvalInfoMask[0] & (1ULL << 25))
+    { //This is noise
+        ismrmrd_acq.sample_time_us() = compute_noise_sample_in_us(scanhead.ushSamplesInScan, isAdjustCoilSens,
+                                                                  isAdjQuietCoilSens, isVB, isNX);
+
+        // std::cout << "Noise sample time us :" << ismrmrd_acq.sample_time_us() << std::endl;
+    } else {
+        ismrmrd_acq.sample_time_us() = dwell_time_0 / 1000.0f;
+    }
+    // std::cout << "ismrmrd_acq.sample_time_us(): " << ismrmrd_acq.sample_time_us() << std::endl;
+
+    ismrmrd_acq.position()[0] = scanhead.sSliceData.sSlicePosVec.flSag;// + (float) (global_table_pos[0]);
+    ismrmrd_acq.position()[1] = scanhead.sSliceData.sSlicePosVec.flCor;// + (float) (global_table_pos[1]);
+    ismrmrd_acq.position()[2] = scanhead.sSliceData.sSlicePosVec.flTra;// + (float) (global_table_pos[2]);
+
+    // Convert Siemens quaternions to direction cosines.
+    // In the Siemens convention the quaternion corresponds to a rotation matrix with columns P R S
+    // Siemens stores the quaternion as (W,X,Y,Z)
+    float quat[4];
+    quat[0] = scanhead.sSliceData.aflQuaternion[1]; // X
+    quat[1] = scanhead.sSliceData.aflQuaternion[2]; // Y
+    quat[2] = scanhead.sSliceData.aflQuaternion[3]; // Z
+    quat[3] = scanhead.sSliceData.aflQuaternion[0]; // W
+    ISMRMRD::ismrmrd_quaternion_to_directions(quat,
+                                              ismrmrd_acq.phase_dir(),
+                                              ismrmrd_acq.read_dir(),
+                                              ismrmrd_acq.slice_dir());
+
+    //std::cout << "scanhead.ulScanCounter         = " << scanhead.ulScanCounter << std::endl;
+    //std::cout << "quat         = [" << quat[0] << " " << quat[1] << " " << quat[2] << " " << quat[3] << "]" << std::endl;
+    //std::cout << "phase_dir    = [" << ismrmrd_acq.phase_dir()[0] << " " << ismrmrd_acq.phase_dir()[1] << " " << ismrmrd_acq.phase_dir()[2] << "]" << std::endl;
+    //std::cout << "read_dir     = [" << ismrmrd_acq.read_dir()[0] << " " << ismrmrd_acq.read_dir()[1] << " " << ismrmrd_acq.read_dir()[2] << "]" << std::endl;
+    //std::cout << "slice_dir    = [" << ismrmrd_acq.slice_dir()[0] << " " << ismrmrd_acq.slice_dir()[1] << " " << ismrmrd_acq.slice_dir()[2] << "]" << std::endl;
+    //std::cout << "--------------------------------------------------------" << std::endl;
+
+    ismrmrd_acq.patient_table_position()[0] = (float) scanhead.lPTABPosX;
+    ismrmrd_acq.patient_table_position()[1] = (float) scanhead.lPTABPosY;
+    ismrmrd_acq.patient_table_position()[2] = (float) scanhead.lPTABPosZ;
+
+    bool fixedE1E2 = true;
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 25))) fixedE1E2 = false; // noise
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) fixedE1E2 = false; // navigator, rt feedback
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 2))) fixedE1E2 = false; // hp feedback
+    if ((scanhead.aulEvalInfoMask[1] & (1ULL << 51-32))) fixedE1E2 = false; // dummy
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 5))) fixedE1E2 = false; // synch data
+
+    ismrmrd_acq.idx().average = scanhead.sLC.ushAcquisition;
+    ismrmrd_acq.idx().contrast = scanhead.sLC.ushEcho;
+    ismrmrd_acq.idx().kspace_encode_step_1 = scanhead.sLC.ushLine;
+    ismrmrd_acq.idx().kspace_encode_step_2 = scanhead.sLC.ushPartition;
+    ismrmrd_acq.idx().phase = scanhead.sLC.ushPhase;
+    ismrmrd_acq.idx().repetition = scanhead.sLC.ushRepetition;
+    ismrmrd_acq.idx().segment = scanhead.sLC.ushSeg;
+    ismrmrd_acq.idx().set = scanhead.sLC.ushSet;
+    ismrmrd_acq.idx().slice = scanhead.sLC.ushSlice;
+    ismrmrd_acq.idx().user[0] = scanhead.sLC.ushIda;
+    ismrmrd_acq.idx().user[1] = scanhead.sLC.ushIdb;
+    ismrmrd_acq.idx().user[2] = scanhead.sLC.ushIdc;
+    ismrmrd_acq.idx().user[3] = scanhead.sLC.ushIdd;
+    ismrmrd_acq.idx().user[4] = scanhead.sLC.ushIde;
+    // TODO: remove this once the GTPlus can properly autodetect partial fourier
+    ismrmrd_acq.idx().user[5] = scanhead.ushKSpaceCentreLineNo;
+    ismrmrd_acq.idx().user[6] = scanhead.ushKSpaceCentrePartitionNo;
+
+    /*****************************************************************************/
+    /* the user_int[0] and user_int[1] are used to store user defined parameters */
+    /*****************************************************************************/
+    ismrmrd_acq.user_int()[0] = scanhead.aushIceProgramPara[0];
+    ismrmrd_acq.user_int()[1] = scanhead.aushIceProgramPara[1];
+    ismrmrd_acq.user_int()[2] = scanhead.aushIceProgramPara[2];
+    ismrmrd_acq.user_int()[3] = scanhead.aushIceProgramPara[3];
+    ismrmrd_acq.user_int()[4] = scanhead.aushIceProgramPara[4];
+    ismrmrd_acq.user_int()[5] = scanhead.aushIceProgramPara[5];
+    ismrmrd_acq.user_int()[6] = scanhead.aushIceProgramPara[6];
+    // TODO: in the newer version of ismrmrd, add field to store time_since_perp_pulse
+    ismrmrd_acq.user_int()[7] = scanhead.ulTimeSinceLastRF;
+
+    ismrmrd_acq.user_float()[0] = scanhead.aushIceProgramPara[8];
+    ismrmrd_acq.user_float()[1] = scanhead.aushIceProgramPara[9];
+    ismrmrd_acq.user_float()[2] = scanhead.aushIceProgramPara[10];
+    ismrmrd_acq.user_float()[3] = scanhead.aushIceProgramPara[11];
+    ismrmrd_acq.user_float()[4] = scanhead.aushIceProgramPara[12];
+    ismrmrd_acq.user_float()[5] = scanhead.aushIceProgramPara[13];
+    ismrmrd_acq.user_float()[6] = scanhead.aushIceProgramPara[14];
+    ismrmrd_acq.user_float()[7] = scanhead.aushIceProgramPara[15];
+
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 25))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_NOISE_MEASUREMENT);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 28))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_FIRST_IN_SLICE);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 29))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_SLICE);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 11))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_REPETITION);
+
+    /// if a line is both image and ref, then do not set the ref flag
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 23))) {
+        ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION_AND_IMAGING);
+    } else {
+        if ((scanhead.aulEvalInfoMask[0] & (1ULL << 22)))
+            ismrmrd_acq.setFlag(
+                    ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION);
+    }
+
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 24))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_REVERSE);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 11))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_MEASUREMENT);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 21))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PHASECORR_DATA);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_NAVIGATION_DATA);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_RTFEEDBACK_DATA);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 2))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_HPFEEDBACK_DATA);
+    if ((scanhead.aulEvalInfoMask[1] & (1ULL << 51-32))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_DUMMYSCAN_DATA);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 10)))
+        ismrmrd_acq.setFlag(
+                ISMRMRD::ISMRMRD_ACQ_IS_SURFACECOILCORRECTIONSCAN_DATA);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 5))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_DUMMYSCAN_DATA);
+    // if ((scanhead.aulEvalInfoMask[0] & (1ULL << 1))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_REPETITION);
+
+    if ((scanhead.aulEvalInfoMask[1] & (1ULL << 46-32))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_LAST_IN_MEASUREMENT);
+
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 14))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PHASE_STABILIZATION_REFERENCE);
+    if ((scanhead.aulEvalInfoMask[0] & (1ULL << 15))) ismrmrd_acq.setFlag(ISMRMRD::ISMRMRD_ACQ_IS_PHASE_STABILIZATION);
+
+    if ((flash_pat_ref_scan) & (ismrmrd_acq.isFlagSet(ISMRMRD::ISMRMRD_ACQ_IS_PARALLEL_CALIBRATION))) {
+        // For some sequences the PAT Reference data is collected using a different encoding space
+        // e.g. EPI scans with FLASH PAT Reference
+        // enabled by command line option
+        // TODO: it is likely that the dwell time is not set properly for this type of acquisition
+        ismrmrd_acq.encoding_space_ref() = 1;
+    }
+
+    if (attachesTrajectory(trajectory, attachTrajectory, scanhead)) {
+
+        // from above we have the following
+        // traj_dim[0] = dimensionality (2)
+        // traj_dim[1] = ngrad i.e. points per interleaf
+        // traj_dim[2] = no. of interleaves
+        // and
+        // traj.getData() is a float * pointer to the trajectory stored
+        // kspace_encode_step_1 is the interleaf number
+
+        unsigned long traj_samples_to_copy = ismrmrd_acq.number_of_samples();
+        if (traj_dim[1] < traj_samples_to_copy) {
+            traj_samples_to_copy = (unsigned long) traj_dim[1];
+            ismrmrd_acq.discard_post() = (uint16_t) (ismrmrd_acq.number_of_samples() - traj_samples_to_copy);
+        }
+        const float *t_ptr = &traj.getDataPtr()[traj_dim[0] * traj_dim[1] * ismrmrd_acq.idx().kspace_encode_step_1];
+        memcpy((void *) ismrmrd_acq.getTrajPtr(), t_ptr, sizeof(float) * traj_dim[0] * traj_samples_to_copy);
+    }
+}
+
+}
+
+ISMRMRD::Acquisition &AcquisitionPool::acquire(const ISMRMRD::AcquisitionHeader &head) {
+    Entry *entry = nullptr;
+    Entry *least_recently_used = nullptr;
+    for (auto &e : entries_) {
+        const ISMRMRD::Acquisition &acq = *e.acquisition;
+        if (acq.number_of_samples() == head.number_of_samples && acq.active_channels() == head.active_channels &&
+            acq.trajectory_dimensions() == head.trajectory_dimensions) {
+            entry = &e;
+            break;
+        }
+        if (!least_recently_used || e.last_use < least_recently_used->last_use) least_recently_used = &e;
+    }
+    if (!entry) {
+        if (entries_.size() < MAX_SHAPES) {
+            entries_.push_back(Entry{0, std::unique_ptr<ISMRMRD::Acquisition>(new ISMRMRD::Acquisition())});
+            entry = &entries_.back();
+        } else {
+            entry = least_recently_used;
+        }
+    }
+    entry->last_use = ++uses_;
+
+    // ISMRMRD reallocates the buffers if the size changed, the counter does not see that on its own
+    ISMRMRD::Acquisition &acq = *entry->acquisition;
+    size_t data_size = acq.getDataSize();
+    size_t traj_size = acq.getTrajSize();
+    acq.setHead(head);
+    if (acq.getDataSize() != data_size || acq.getTrajSize() != traj_size) countAllocation();
+    return acq;
+}
+
+AcquisitionParameters::AcquisitionParameters()
+    : VBFILE(false)
+    , trajectory(Trajectory::TRAJECTORY_CARTESIAN)
+    , dwell_time_0(0)
+    , max_channels(0)
+    , isAdjustCoilSens(false)
+    , isAdjQuietCoilSens(false)
+    , isVB(false)
+    , isNX(false)
+    , flash_pat_ref_scan(false)
+    , attachTrajectory(false) {
+}
+
+AcquisitionDecoder::AcquisitionDecoder(const AcquisitionParameters &parameters)
+    : parameters_(parameters) {
+    traj_dim_ = parameters_.traj.getDims();
+}
+
+ISMRMRD::Acquisition &AcquisitionDecoder::decode(const sScanHeader &scanhead, const char *block,
+                                                 AcquisitionPool &pool) const {
+    const AcquisitionParameters &p = parameters_;
+    //Size the acquisition from the scan header and copy the channel samples straight into it
+    ISMRMRD::Acquisition &acq = resizeAcquisition(p.trajectory, p.attachTrajectory, traj_dim_, scanhead, pool);
+    decodeChannelData(block, p.VBFILE, scanhead, acq);
+    getAcquisition(p.flash_pat_ref_scan, p.trajectory, p.dwell_time_0, p.max_channels, p.isAdjustCoilSens,
+                   p.isAdjQuietCoilSens, p.isVB, p.isNX, p.attachTrajectory, p.traj, traj_dim_, scanhead, acq);
+    return acq;
+}
+
+AcquisitionFetcher::AcquisitionFetcher(const std::string &filename, IoBackend backend, const MeasurementIndex &index,
+                                       const AcquisitionParameters &parameters, int32_t meas_uid)
+    : reader_(filename, backend, parameters.VBFILE, index), decoder_(parameters), meas_uid_(meas_uid) {
+}
+
+std::vector<ISMRMRD::Acquisition> AcquisitionFetcher::fetch(const ScanQuery &query) {
+    std::vector<ISMRMRD::Acquisition> acquisitions;
+    AcquisitionPool pool;
+    sScanHeader scanhead;
+    for (size_t i : reader_.find(query)) {
+        // ACQEND scans are never written
+        if (reader_.index().scans[i].eval_info_mask[0] & 1) continue;
+        acquisitions.push_back(fetch(i, scanhead, pool));
+    }
+    return acquisitions;
+}
+
+void AcquisitionFetcher::readHeader(size_t i, sScanHeader &scanhead) {
+    reader_.read(i, scanhead, buffer_);
+    if (!decoder_.parameters().VBFILE) scanhead.lMeasUID = meas_uid_;
+}
+
+ISMRMRD::Acquisition &AcquisitionFetcher::fetch(size_t i, sScanHeader &scanhead, AcquisitionPool &pool) {
+    const char *block = reader_.read(i, scanhead, buffer_);
+    if (!decoder_.parameters().VBFILE) scanhead.lMeasUID = meas_uid_;
+    return decoder_.decode(scanhead, block, pool);
+}
@@ -0,0 +1,100 @@
+#ifndef SCANDECODER_H_
+#define SCANDECODER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "siemensraw.h"
+#include "datinput.h"
+#include "scanindex.h"
+
+#include "ismrmrd/ismrmrd.h"
+
+/// Acquisitions kept for reuse, one per data shape seen recently. ISMRMRD reallocates the buffers
+/// of an acquisition whenever its size changes, picking the acquisition of the same shape avoids
+/// that when e.g. noise, navigator and imaging scans of different sizes are interleaved.
+class AcquisitionPool {
+public:
+    AcquisitionPool() : uses_(0) { entries_.reserve(MAX_SHAPES); }
+
+    /// Returns the acquisition sized for head, with head as its header
+    ISMRMRD::Acquisition &acquire(const ISMRMRD::AcquisitionHeader &head);
+
+private:
+    // Shapes kept at once, the least recently used one is resized for a new shape
+    static const size_t MAX_SHAPES = 4;
+
+    struct Entry {
+        uint64_t last_use;
+        std::unique_ptr<ISMRMRD::Acquisition> acquisition;
+    };
+
+    std::vector<Entry> entries_;
+    uint64_t uses_;
+};
+
+/// What decoding the scans of a measurement needs to know beyond their scan headers, taken from the
+/// measurement's parameter buffers and the command line
+struct AcquisitionParameters
+{
+    AcquisitionParameters();
+
+    bool VBFILE;
+    Trajectory trajectory;
+    long dwell_time_0;       // Dwell time of the imaging scans in ns
+    long max_channels;       // Receiver channels, the available channels of every acquisition
+    bool isAdjustCoilSens;   // Coil sensitivity adjustment protocols, their noise scans have a fixed dwell time
+    bool isAdjQuietCoilSens;
+    bool isVB;               // VB line baseline
+    bool isNX;               // Numaris/X baseline
+    bool flash_pat_ref_scan; // PAT reference scans go to the second encoding space
+    bool attachTrajectory;   // Attach traj to spiral acquisitions
+    ISMRMRD::NDArray<float> traj; // Spiral trajectory: dimensions x samples per interleaf x interleaves
+};
+
+/// Turns the scans of a measurement into ISMRMRD acquisitions. Safe to use from several threads at
+/// once, each with its own AcquisitionPool.
+class AcquisitionDecoder {
+public:
+    explicit AcquisitionDecoder(const AcquisitionParameters &parameters);
+
+    /// Decodes the scan with header scanhead, whose data follows at block, into an acquisition of pool.
+    /// The acquisition stays valid until pool hands it out again.
+    ISMRMRD::Acquisition &decode(const sScanHeader &scanhead, const char *block, AcquisitionPool &pool) const;
+
+    const AcquisitionParameters &parameters() const { return parameters_; }
+
+private:
+    AcquisitionParameters parameters_;
+    std::vector<size_t> traj_dim_; // getDims returns a copy, it is looked up once rather than for every scan
+};
+
+/// Random access to the acquisitions of a measurement by scan counter or loop counters, through its
+/// scan index. Reads only the requested scans. Used by a single thread.
+class AcquisitionFetcher {
+public:
+    /// meas_uid replaces the measurement UID in the scan headers of VD line files, as in a full conversion
+    AcquisitionFetcher(const std::string &filename, IoBackend backend, const MeasurementIndex &index,
+                       const AcquisitionParameters &parameters, int32_t meas_uid);
+
+    const IndexedScanReader &reader() const { return reader_; }
+
+    /// The acquisitions matching query, in file order. Sync data and the ACQEND scan are left out.
+    std::vector<ISMRMRD::Acquisition> fetch(const ScanQuery &query);
+
+    /// Reads the header of scan i of the index
+    void readHeader(size_t i, sScanHeader &scanhead);
+
+    /// Reads scan i of the index and decodes it into an acquisition of pool, scanhead receives its header
+    ISMRMRD::Acquisition &fetch(size_t i, sScanHeader &scanhead, AcquisitionPool &pool);
+
+private:
+    IndexedScanReader reader_;
+    AcquisitionDecoder decoder_;
+    int32_t meas_uid_;
+    std::vector<char> buffer_;
+};
+
+#endif //SCANDECODER_H_
@@ -0,0 +1,441 @@
+#include "scanindex.h"
+
+#include <boost/filesystem.hpp>
+
+#include <boost/algorithm/string.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+size_t scanDataLength(bool VBFILE, const sScanHeader &scanhead) {
+    // Everything following the scan header up to the next scan. Derived from the header fields
+    // so the stream ends up exactly where reading the channels one by one used to leave it.
+    size_t nchannels = scanhead.ushUsedChannels;
+    size_t channel_samples_length = scanhead.ushSamplesInScan * 2 * sizeof(float);
+
+    if (VBFILE) {
+        // Every channel has its own MDH, the first one has already been read as scan header
+        return nchannels ? nchannels * (sizeof(sMDH) + channel_samples_length) - sizeof(sMDH) : 0;
+    }
+    return nchannels * (sizeof(sChannelHeader) + channel_samples_length);
+}
+
+void readScanHeader(std::istream &siemens_dat, bool VBFILE, sMDH &mdh, sScanHeader &scanhead) {
+    const size_t header_length = VBFILE ? sizeof(sMDH) : sizeof(sScanHeader);
+
+    DatInputBuf *buf = dynamic_cast<DatInputBuf *>(siemens_dat.rdbuf());
+    const char *header = buf && siemens_dat.good() ? buf->view(header_length) : nullptr;
+    if (header) {
+        decodeScanHeader(header, VBFILE, scanhead);
+    } else if (VBFILE) {
+        siemens_dat.read(reinterpret_cast<char *>(&mdh), sizeof(sMDH));
+        scanHeaderFromMdh(mdh, scanhead);
+    } else {
+        siemens_dat.read(reinterpret_cast<char *>(&scanhead), sizeof(sScanHeader));
+    }
+}
+
+void decodeScanHeader(const char *block, bool VBFILE, sScanHeader &scanhead) {
+    if (VBFILE) {
+        scanHeaderFromMdh(block, scanhead);
+    } else {
+        memcpy(&scanhead, block, sizeof(sScanHeader));
+    }
+}
+
+void scanHeaderFromMdh(const sMDH &mdh, sScanHeader &scanhead) {
+    scanHeaderFromMdh(reinterpret_cast<const char *>(&mdh), scanhead);
+}
+
+void scanHeaderFromMdh(const char *mdh, sScanHeader &scanhead) {
+    // Each field is copied once, from its place in the MDH to its place in the scan header
+#define MDH_FIELD(to, from) memcpy(&scanhead.to, mdh + offsetof(sMDH, from), sizeof(scanhead.to))
+    MDH_FIELD(ulFlagsAndDMALength, ulFlagsAndDMALength);
+    MDH_FIELD(lMeasUID, lMeasUID);
+    MDH_FIELD(ulScanCounter, ulScanCounter);
+    MDH_FIELD(ulTimeStamp, ulTimeStamp);
+    MDH_FIELD(ulPMUTimeStamp, ulPMUTimeStamp);
+    MDH_FIELD(aulEvalInfoMask, aulEvalInfoMask);
+    MDH_FIELD(ushSamplesInScan, ushSamplesInScan);
+    MDH_FIELD(ushUsedChannels, ushUsedChannels);
+    MDH_FIELD(sLC, sLC);
+    MDH_FIELD(sCutOff, sCutOff);
+    MDH_FIELD(ushKSpaceCentreColumn, ushKSpaceCentreColumn);
+    MDH_FIELD(ushCoilSelect, ushCoilSelect);
+    MDH_FIELD(fReadOutOffcentre, fReadOutOffcentre);
+    MDH_FIELD(ulTimeSinceLastRF, ulTimeSinceLastRF);
+    MDH_FIELD(ushKSpaceCentreLineNo, ushKSpaceCentreLineNo);
+    MDH_FIELD(ushKSpaceCentrePartitionNo, ushKSpaceCentrePartitionNo);
+    MDH_FIELD(sSliceData, sSliceData);
+#undef MDH_FIELD
+
+    uint16_t ptab_pos_neg;
+    memcpy(&ptab_pos_neg, mdh + offsetof(sMDH, ushPTABPosNeg), sizeof(ptab_pos_neg));
+
+    scanhead.ushSystemType = 0;
+    scanhead.ulPTABPosDelay = 0;
+    scanhead.lPTABPosX = 0;
+    scanhead.lPTABPosY = 0;
+    scanhead.lPTABPosZ = ptab_pos_neg;//TODO: Modify calculation
+    scanhead.ulReserved1 = 0;
+    memset(scanhead.aushIceProgramPara, 0, sizeof(uint16_t) * 24);
+    // The four ICE program parameters are followed by the four free parameters in the MDH
+    memcpy(scanhead.aushIceProgramPara, mdh + offsetof(sMDH, aushIceProgramPara), 8 * sizeof(uint16_t));
+    memset(scanhead.aushReservedPara, 0, sizeof(uint16_t) * 4);
+    scanhead.ushApplicationCounter = 0;
+    scanhead.ushApplicationMask = 0;
+    scanhead.ulCRC = 0;
+}
+
+uint64_t measurementDataOffset(std::istream &siemens_dat, uint64_t offset) {
+    siemens_dat.seekg(offset, std::ios::beg);
+
+    uint32_t dma_length = 0, num_buffers = 0;
+    siemens_dat.read((char *) (&dma_length), sizeof(uint32_t));
+    siemens_dat.read((char *) (&num_buffers), sizeof(uint32_t));
+
+    // Same reads as readMeasurementHeaderBuffers, without keeping the buffers
+    char tmp_bufname[32];
+    for (uint32_t b = 0; b < num_buffers; b++) {
+        siemens_dat.getline(tmp_bufname, 32, '\0');
+        uint32_t buflen = 0;
+        siemens_dat.read((char *) (&buflen), sizeof(buflen));
+        siemens_dat.seekg(buflen, std::ios::cur);
+    }
+
+    //We need to be on a 32 byte boundary after reading the buffers
+    long long int position_in_meas = (long long int) (siemens_dat.tellg()) - offset;
+    if (position_in_meas % 32 != 0) {
+        siemens_dat.seekg(32 - (position_in_meas % 32), std::ios::cur);
+    }
+
+    if (!siemens_dat) throw std::runtime_error("Failed to read the measurement header");
+    return siemens_dat.tellg();
+}
+
+MeasurementIndex indexMeasurement(std::istream &siemens_dat, bool VBFILE, const MrParcRaidFileEntry &entry,
+                                  uint64_t data_offset) {
+    MeasurementIndex index;
+    index.offset = entry.off_;
+    index.length = entry.len_;
+    index.data_offset = data_offset;
+
+    siemens_dat.clear();
+    siemens_dat.seekg(0, std::ios::end);
+    int64_t file_size = siemens_dat.tellg();
+
+    const int64_t header_length = VBFILE ? sizeof(sMDH) : sizeof(sScanHeader);
+    const int64_t measurement_end = entry.off_ + entry.len_;
+    int64_t pos = data_offset;
+    sMDH mdh;
+    sScanHeader scanhead;
+
+    for (;;) {
+        if (measurement_end - pos <= (int64_t) sizeof(sScanHeader)) {
+            index.end_reason = MeasurementIndex::END_OF_MEASUREMENT;
+            break;
+        }
+
+        siemens_dat.seekg(pos, std::ios::beg);
+        readScanHeader(siemens_dat, VBFILE, mdh, scanhead);
+        if (!siemens_dat) {
+            siemens_dat.clear();
+            index.end_reason = MeasurementIndex::HEADER_ERROR;
+            break;
+        }
+
+        ScanIndexEntry scan;
+        memset(&scan, 0, sizeof(scan));
+        scan.offset = pos;
+        scan.dma_length = scanhead.ulFlagsAndDMALength & MDH_DMA_LENGTH_MASK;
+        scan.eval_info_mask[0] = scanhead.aulEvalInfoMask[0];
+        scan.eval_info_mask[1] = scanhead.aulEvalInfoMask[1];
+        scan.scan_counter = scanhead.ulScanCounter;
+        scan.meas_uid = scanhead.lMeasUID;
+        scan.lc = scanhead.sLC;
+        scan.samples = scanhead.ushSamplesInScan;
+        scan.channels = scanhead.ushUsedChannels;
+
+        if (scanhead.aulEvalInfoMask[0] & MDH_SYNCDATA) {
+            // Sync data is skipped by its DMA length, a cut off packet shows as a header error next
+            scan.data_length = scan.dma_length - header_length;
+            index.scans.push_back(scan);
+            pos += header_length + scan.data_length;
+            continue;
+        }
+
+        scan.data_length = scanDataLength(VBFILE, scanhead);
+        index.scans.push_back(scan);
+
+        if (pos + header_length + (int64_t) scan.data_length > file_size) {
+            index.end_reason = MeasurementIndex::DATA_ERROR;
+            pos += header_length;
+            break;
+        }
+        pos += header_length + scan.data_length;
+
+        if (scanhead.aulEvalInfoMask[0] & 1) {
+            index.end_reason = MeasurementIndex::ACQEND;
+            break;
+        }
+    }
+
+    index.end_offset = pos;
+    return index;
+}
+
+DatFileIndex buildDatFileIndex(std::istream &siemens_dat, const std::string &filename, bool VBFILE,
+                               const std::vector<MrParcRaidFileEntry> &entries, uint32_t count) {
+    DatFileIndex index;
+    index.VBFILE = VBFILE;
+    index.file_size = boost::filesystem::file_size(filename);
+    index.mtime = boost::filesystem::last_write_time(filename);
+
+    for (uint32_t m = 0; m < count; m++) {
+        uint64_t data_offset = measurementDataOffset(siemens_dat, entries[m].off_);
+        index.measurements.push_back(indexMeasurement(siemens_dat, VBFILE, entries[m], data_offset));
+    }
+
+    siemens_dat.clear();
+    return index;
+}
+
+namespace {
+
+const char SCAN_INDEX_MAGIC[8] = {'S', '2', 'I', 'S', 'C', 'A', 'N', 'X'};
+const uint32_t SCAN_INDEX_VERSION = 1;
+
+/// Fixed size part of a measurement in the index file, followed by its scans
+struct MeasurementRecord
+{
+    uint64_t offset;
+    uint64_t length;
+    uint64_t data_offset;
+    uint64_t end_offset;
+    uint32_t end_reason;
+    uint32_t reserved;
+    uint64_t num_scans;
+};
+
+struct IndexFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t VBFILE;
+    uint64_t file_size;
+    int64_t mtime;
+    uint32_t scan_entry_size; // Catches layout changes of ScanIndexEntry
+    uint32_t num_measurements;
+};
+
+}
+
+std::string scanIndexFilename(const std::string &dat_filename) {
+    return dat_filename + ".scanidx";
+}
+
+bool loadScanIndex(const std::string &dat_filename, DatFileIndex &index) {
+    std::ifstream in(scanIndexFilename(dat_filename).c_str(), std::ios::in | std::ios::binary);
+    if (!in) return false;
+
+    IndexFileHeader header;
+    in.read((char *) &header, sizeof(header));
+    if (!in || memcmp(header.magic, SCAN_INDEX_MAGIC, sizeof(SCAN_INDEX_MAGIC)) != 0 ||
+        header.version != SCAN_INDEX_VERSION || header.scan_entry_size != sizeof(ScanIndexEntry)) {
+        std::cerr << "WARNING: Ignoring unreadable scan index " << scanIndexFilename(dat_filename) << std::endl;
+        return false;
+    }
+
+    boost::system::error_code ec;
+    uint64_t file_size = boost::filesystem::file_size(dat_filename, ec);
+    int64_t mtime = boost::filesystem::last_write_time(dat_filename, ec);
+    if (ec || header.file_size != file_size || header.mtime != mtime) {
+        std::cerr << "WARNING: Ignoring stale scan index " << scanIndexFilename(dat_filename) << std::endl;
+        return false;
+    }
+
+    index.VBFILE = header.VBFILE != 0;
+    index.file_size = header.file_size;
+    index.mtime = header.mtime;
+    index.measurements.resize(header.num_measurements);
+
+    for (auto &measurement : index.measurements) {
+        MeasurementRecord record;
+        in.read((char *) &record, sizeof(record));
+        if (!in || record.num_scans > file_size / sizeof(sMDH)) return false;
+
+        measurement.offset = record.offset;
+        measurement.length = record.length;
+        measurement.data_offset = record.data_offset;
+        measurement.end_offset = record.end_offset;
+        measurement.end_reason = (MeasurementIndex::EndReason) record.end_reason;
+        measurement.scans.resize(record.num_scans);
+        in.read((char *) measurement.scans.data(), record.num_scans * sizeof(ScanIndexEntry));
+        if (!in) return false;
+    }
+    return true;
+}
+
+void saveScanIndex(const std::string &dat_filename, const DatFileIndex &index) {
+    // Written under a temporary name and renamed, so readers never see a partial index
+    std::string filename = scanIndexFilename(dat_filename);
+    std::string tmp_filename = filename + ".tmp";
+    {
+        std::ofstream out(tmp_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("Failed to create " + tmp_filename);
+
+        IndexFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SCAN_INDEX_MAGIC, sizeof(SCAN_INDEX_MAGIC));
+        header.version = SCAN_INDEX_VERSION;
+        header.VBFILE = index.VBFILE;
+        header.file_size = index.file_size;
+        header.mtime = index.mtime;
+        header.scan_entry_size = sizeof(ScanIndexEntry);
+        header.num_measurements = index.measurements.size();
+        out.write((const char *) &header, sizeof(header));
+
+        for (const auto &measurement : index.measurements) {
+            MeasurementRecord record;
+            memset(&record, 0, sizeof(record));
+            record.offset = measurement.offset;
+            record.length = measurement.length;
+            record.data_offset = measurement.data_offset;
+            record.end_offset = measurement.end_offset;
+            record.end_reason = measurement.end_reason;
+            record.num_scans = measurement.scans.size();
+            out.write((const char *) &record, sizeof(record));
+            out.write((const char *) measurement.scans.data(), measurement.scans.size() * sizeof(ScanIndexEntry));
+        }
+
+        if (!out) throw std::runtime_error("Failed to write " + tmp_filename);
+    }
+    boost::filesystem::rename(tmp_filename, filename);
+}
+
+ScanQuery::ScanQuery() : scan_counter(-1) {
+    for (auto &c : lc) c = -1;
+}
+
+bool ScanQuery::matches(const ScanIndexEntry &scan) const {
+    if (scan.eval_info_mask[0] & MDH_SYNCDATA) return false;
+    if (scan_counter >= 0 && scan.scan_counter != (uint32_t) scan_counter) return false;
+
+    const uint16_t *counters = reinterpret_cast<const uint16_t *>(&scan.lc);
+    for (size_t i = 0; i < 14; i++) {
+        if (lc[i] >= 0 && counters[i] != lc[i]) return false;
+    }
+    return true;
+}
+
+ScanQuery parseScanQuery(const std::string &query) {
+    static const char *lc_names[14] = {"line", "acquisition", "slice", "partition", "echo", "phase", "repetition",
+                                       "set", "seg", "ida", "idb", "idc", "idd", "ide"};
+    ScanQuery result;
+
+    std::vector<std::string> terms;
+    boost::algorithm::split(terms, query, boost::is_any_of(","));
+    for (auto &term : terms) {
+        std::vector<std::string> kv;
+        boost::algorithm::split(kv, term, boost::is_any_of("="));
+        if (kv.size() != 2) throw std::runtime_error("Malformed scan query term: " + term);
+        boost::algorithm::trim(kv[0]);
+        long value = std::stol(kv[1]);
+
+        if (kv[0] == "scan") {
+            result.scan_counter = value;
+            continue;
+        }
+
+        size_t i = 0;
+        while (i < 14 && kv[0] != lc_names[i]) i++;
+        if (i == 14) throw std::runtime_error("Unknown scan query field: " + kv[0]);
+        result.lc[i] = value;
+    }
+    return result;
+}
+
+IndexedScanReader::IndexedScanReader(const std::string &filename, IoBackend backend, bool VBFILE,
+                                     const MeasurementIndex &index)
+    : file_(filename, backend), VBFILE_(VBFILE), index_(index) {
+}
+
+std::vector<size_t> IndexedScanReader::find(const ScanQuery &query) const {
+    // A cut off last scan can not be read
+    size_t count = index_.scans.size();
+    if (index_.end_reason == MeasurementIndex::DATA_ERROR && count) count--;
+
+    std::vector<size_t> found;
+    for (size_t i = 0; i < count; i++) {
+        if (query.matches(index_.scans[i])) found.push_back(i);
+    }
+    return found;
+}
+
+const char *IndexedScanReader::read(size_t i, sScanHeader &scanhead, std::vector<char> &buffer) const {
+    const ScanIndexEntry &scan = index_.scans.at(i);
+    size_t header_length = VBFILE_ ? sizeof(sMDH) : sizeof(sScanHeader);
+
+    // Header and data are contiguous, fetch them with a single positional read
+    const char *data = file_.read(scan.offset, header_length + scan.data_length, buffer);
+    decodeScanHeader(data, VBFILE_, scanhead);
+    return data + header_length;
+}
+
+namespace {
+
+bool inRanges(const LoopCounterFilter::Ranges &ranges, uint16_t value) {
+    if (ranges.empty()) return true;
+    for (const auto &range : ranges) {
+        if (value >= range.first && value <= range.second) return true;
+    }
+    return false;
+}
+
+/// Parses a non-negative loop counter bound, returns false unless all of text is a number
+bool parseBound(std::string text, long &value) {
+    boost::algorithm::trim(text);
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    size_t pos = 0;
+    try {
+        value = std::stol(text, &pos);
+    }
+    catch (const std::out_of_range &) {
+        return false;
+    }
+    return pos == text.size();
+}
+
+}
+
+bool LoopCounterFilter::empty() const {
+    return slices.empty() && repetitions.empty() && contrasts.empty() && sets.empty();
+}
+
+bool LoopCounterFilter::matches(const mdhLC &lc, uint32_t eval_info_mask) const {
+    if (eval_info_mask & (MDH_NOISEADJSCAN | MDH_PATREFSCAN | MDH_PHASCOR)) return true;
+    return inRanges(slices, lc.ushSlice) && inRanges(repetitions, lc.ushRepetition) &&
+           inRanges(contrasts, lc.ushEcho) && inRanges(sets, lc.ushSet);
+}
+
+LoopCounterFilter::Ranges parseRanges(const std::string &ranges) {
+    LoopCounterFilter::Ranges result;
+
+    std::vector<std::string> terms;
+    boost::algorithm::split(terms, ranges, boost::is_any_of(","));
+    for (auto &term : terms) {
+        std::vector<std::string> bounds;
+        boost::algorithm::split(bounds, term, boost::is_any_of("-"));
+        long lower, upper;
+        // Negative, empty and reversed bounds would silently select nothing
+        if (bounds.size() > 2 || !parseBound(bounds[0], lower) || !parseBound(bounds.back(), upper) ||
+            lower > upper) {
+            throw std::runtime_error("Malformed range: " + term);
+        }
+        result.push_back(std::make_pair(lower, upper));
+    }
+    return result;
+}
@@ -0,0 +1,145 @@
+#ifndef SCANINDEX_H_
+#define SCANINDEX_H_
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "siemensraw.h"
+#include "datinput.h"
+
+/// Length of the data following a scan header up to the next scan
+size_t scanDataLength(bool VBFILE, const sScanHeader &scanhead);
+
+/// Reads the next scan header, VB line MDHs are converted to a VD line scan header.
+/// The header is decoded straight out of the stream's buffer where possible, mdh is only
+/// used when it has to be copied out first.
+void readScanHeader(std::istream &siemens_dat, bool VBFILE, sMDH &mdh, sScanHeader &scanhead);
+
+/// Same as readScanHeader for a header that is already in memory
+void decodeScanHeader(const char *block, bool VBFILE, sScanHeader &scanhead);
+
+void scanHeaderFromMdh(const sMDH &mdh, sScanHeader &scanhead);
+
+/// Fills the scan header from the raw bytes of a VB line MDH, which need not be aligned
+void scanHeaderFromMdh(const char *mdh, sScanHeader &scanhead);
+
+/// A scan as the converter walks over it. Stored as is in the sidecar index file.
+struct ScanIndexEntry
+{
+    uint64_t offset;             // File offset of the scan header
+    uint32_t dma_length;         // ulFlagsAndDMALength & MDH_DMA_LENGTH_MASK
+    uint32_t data_length;        // Bytes following the header up to the next scan
+    uint32_t eval_info_mask[2];
+    uint32_t scan_counter;
+    int32_t meas_uid;
+    mdhLC lc;
+    uint16_t samples;
+    uint16_t channels;
+};
+
+/// The scans of one measurement, in file order
+struct MeasurementIndex
+{
+    /// Why the walk over the measurement stopped
+    enum EndReason : uint32_t {
+        ACQEND,             // The last scan has the ACQEND flag set
+        END_OF_MEASUREMENT, // Ran into the end of the measurement without ACQEND
+        HEADER_ERROR,       // The header following the last scan could not be read
+        DATA_ERROR          // The data of the last scan is cut off
+    };
+
+    uint64_t offset;      // MrParcRaidFileEntry offset and length of the measurement
+    uint64_t length;
+    uint64_t data_offset; // First scan header, following the measurement header
+    uint64_t end_offset;  // Position after the last complete scan
+    EndReason end_reason;
+    std::vector<ScanIndexEntry> scans;
+};
+
+/// Scan index of a whole dat file, stored next to it for later runs
+struct DatFileIndex
+{
+    bool VBFILE;
+    uint64_t file_size; // Size and modification time of the dat file the index belongs to
+    int64_t mtime;
+    std::vector<MeasurementIndex> measurements; // Measurement number n is at n - 1
+};
+
+/// Skips the measurement header (parameter buffers) at offset and returns the offset of the first scan
+uint64_t measurementDataOffset(std::istream &siemens_dat, uint64_t offset);
+
+/// Walks the scan headers of a measurement starting at data_offset. Follows the scan lengths
+/// exactly like the converter does, without reading any of the scan data.
+MeasurementIndex indexMeasurement(std::istream &siemens_dat, bool VBFILE, const MrParcRaidFileEntry &entry,
+                                  uint64_t data_offset);
+
+/// Indexes all measurements of the dat file
+DatFileIndex buildDatFileIndex(std::istream &siemens_dat, const std::string &filename, bool VBFILE,
+                               const std::vector<MrParcRaidFileEntry> &entries, uint32_t count);
+
+/// Picks scans out of a measurement by scan counter and/or loop counters.
+/// Fields left at -1 match any scan, sync data never matches.
+struct ScanQuery
+{
+    ScanQuery();
+
+    long scan_counter;
+    long lc[14]; // In mdhLC order: line, acquisition, slice, partition, echo, phase, repetition, set, seg, ida..ide
+
+    bool matches(const ScanIndexEntry &scan) const;
+};
+
+/// Parses "scan=1234" or loop counters like "line=64,partition=32,repetition=0", throws on unknown names
+ScanQuery parseScanQuery(const std::string &query);
+
+/// Inclusive ranges of loop counters to convert (--slices 3-5 etc.), no ranges accept everything.
+/// Noise adjust, PAT reference and phase correction scans are always converted, the reconstruction
+/// of the selected scans needs them whatever their loop counters are.
+struct LoopCounterFilter
+{
+    typedef std::vector<std::pair<long, long> > Ranges;
+
+    Ranges slices;
+    Ranges repetitions;
+    Ranges contrasts; // mdhLC echo
+    Ranges sets;
+
+    bool empty() const;
+    bool matches(const mdhLC &lc, uint32_t eval_info_mask) const;
+};
+
+/// Parses ranges like "3-5", "0" or "0,2,7-9", throws on reversed, negative or non-numeric ranges
+LoopCounterFilter::Ranges parseRanges(const std::string &ranges);
+
+/// Random access to the scans of a measurement through its index
+class IndexedScanReader {
+public:
+    IndexedScanReader(const std::string &filename, IoBackend backend, bool VBFILE, const MeasurementIndex &index);
+
+    const MeasurementIndex &index() const { return index_; }
+
+    /// Positions of the matching scans in index().scans, in file order
+    std::vector<size_t> find(const ScanQuery &query) const;
+
+    /// Reads the header of scan i and returns its data, pointing into buffer or the file mapping
+    const char *read(size_t i, sScanHeader &scanhead, std::vector<char> &buffer) const;
+
+private:
+    PositionalDatFile file_;
+    bool VBFILE_;
+    const MeasurementIndex &index_;
+};
+
+/// Sidecar index file name for the dat file
+std::string scanIndexFilename(const std::string &dat_filename);
+
+/// Loads the sidecar index of the dat file. Returns false if there is none, or if it is
+/// unreadable or does not match the dat file's size and modification time anymore.
+bool loadScanIndex(const std::string &dat_filename, DatFileIndex &index);
+
+/// Writes the sidecar index of the dat file, throws on failure
+void saveScanIndex(const std::string &dat_filename, const DatFileIndex &index);
+
+#endif //SCANINDEX_H_
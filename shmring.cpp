@@ -0,0 +1,314 @@
+#include "shmring.h"
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "The ring's atomics have to be lock free to work across processes");
+
+namespace {
+
+const uint32_t SHM_RING_MAGIC = 0x5244524d; // "MRDR"
+const uint32_t SHM_RING_VERSION = 2;
+
+// The records start one page after the control block
+const size_t CONTROL_SIZE = 4096;
+static_assert(sizeof(ShmRingControl) <= CONTROL_SIZE, "The control block has to fit into its page");
+
+// Waits wake up at this interval even without a wake, a safety net against a peer that went away
+const long WAIT_TIMEOUT_NS = 100 * 1000 * 1000;
+
+/// Waits until word no longer holds value, a wake on it, or the timeout
+void waitOn(std::atomic<uint32_t> &word, uint32_t value) {
+#ifdef __linux__
+    timespec timeout = {0, WAIT_TIMEOUT_NS};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+#else
+    if (word.load() == value) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+#ifndef _WIN32
+/// True unless the process pid has exited
+bool processAlive(uint32_t pid) {
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+}
+#endif
+
+void wakeAll(std::atomic<uint32_t> &word) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void) word;
+#endif
+}
+
+}
+
+ShmAcquisition ShmRecord::acquisition() const {
+    ShmAcquisition acq;
+    acq.head = reinterpret_cast<const ISMRMRD::AcquisitionHeader *>(payload);
+    acq.traj = reinterpret_cast<const float *>(payload + sizeof(ISMRMRD::AcquisitionHeader));
+    size_t traj_bytes = (size_t) acq.head->number_of_samples * acq.head->trajectory_dimensions * sizeof(float);
+    acq.data = reinterpret_cast<const complex_float_t *>(payload - sizeof(ShmRecordHeader) +
+                                                         ShmAcquisition::dataOffset(traj_bytes));
+    return acq;
+}
+
+#ifndef _WIN32
+
+ShmRingWriter::ShmRingWriter(const std::string &name, size_t capacity, unsigned int reader_timeout_s)
+    : name_(name)
+    , reader_timeout_(reader_timeout_s)
+    , mapping_(nullptr)
+    , mapping_size_(CONTROL_SIZE + shmAlign(capacity))
+    , control_(nullptr)
+    , data_(nullptr)
+    , position_(0)
+    , end_position_(0) {
+    // A ring left behind by an earlier run is replaced, its reader keeps its own mapping
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) throw std::runtime_error("Failed to create shared memory " + name_ + ": " + strerror(errno));
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    // Fault the ring in now rather than while publishing the first scans
+    flags |= MAP_POPULATE;
+#endif
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, mapping_size_) == 0) {
+        mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, flags, fd, 0);
+    }
+    int error = errno;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("Failed to map shared memory " + name_ + ": " + strerror(error));
+    }
+    mapping_ = static_cast<char *>(mapping);
+    data_ = mapping_ + CONTROL_SIZE;
+
+    // The object is zero filled, which is where the positions and futexes start
+    control_ = new (mapping_) ShmRingControl;
+    control_->version = SHM_RING_VERSION;
+    control_->capacity = mapping_size_ - CONTROL_SIZE;
+    control_->data_offset = CONTROL_SIZE;
+    control_->magic.store(SHM_RING_MAGIC);
+}
+
+ShmRingWriter::~ShmRingWriter() {
+    control_->writer_closed.store(1);
+    control_->data_futex.fetch_add(1);
+    wakeAll(control_->data_futex);
+    munmap(mapping_, mapping_size_);
+}
+
+char *ShmRingWriter::begin(ShmRecordType type, size_t size) {
+    const uint64_t capacity = control_->capacity;
+    uint64_t stride = shmAlign(sizeof(ShmRecordHeader) + size);
+    if (stride > capacity) {
+        throw std::runtime_error("A record of " + std::to_string(size) + " bytes does not fit into shared memory " +
+                                 name_);
+    }
+    // Records do not wrap around, the rest of the ring is skipped if the record does not fit before its end
+    uint64_t offset = position_ % capacity;
+    uint64_t padding = capacity - offset < stride ? capacity - offset : 0;
+    uint64_t end = position_ + padding + stride;
+
+    // Back-pressure: wait for the reader to release the records the new one overwrites
+    auto waiting_since = std::chrono::steady_clock::now();
+    while (control_->read_position.load() + capacity < end) {
+        uint32_t released = control_->space_futex.load();
+        control_->writer_waiting.store(1);
+        if (control_->read_position.load() + capacity >= end) break;
+        waitOn(control_->space_futex, released);
+        checkReader(waiting_since);
+    }
+
+    if (padding) {
+        ShmRecordHeader *skip = reinterpret_cast<ShmRecordHeader *>(data_ + offset);
+        skip->type = static_cast<uint32_t>(ShmRecordType::PADDING);
+        skip->reserved = 0;
+        skip->size = padding - sizeof(ShmRecordHeader);
+        offset = 0;
+    }
+    ShmRecordHeader *record = reinterpret_cast<ShmRecordHeader *>(data_ + offset);
+    record->type = static_cast<uint32_t>(type);
+    record->reserved = 0;
+    record->size = size;
+    end_position_ = end;
+    return reinterpret_cast<char *>(record + 1);
+}
+
+void ShmRingWriter::checkReader(std::chrono::steady_clock::time_point waiting_since) const {
+    // The incomplete measurement is not left behind for a later reader
+    uint32_t pid = control_->reader_pid.load();
+    if (pid != 0) {
+        if (!processAlive(pid)) {
+            shm_unlink(name_.c_str());
+            throw std::runtime_error("The reader of shared memory " + name_ + " (process " + std::to_string(pid) +
+                                     ") exited without reading the measurement");
+        }
+        return;
+    }
+    // A slow reader is waited for as long as it takes, a missing one only for the timeout
+    if (std::chrono::steady_clock::now() - waiting_since >= reader_timeout_) {
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("Shared memory " + name_ + " is full and no reader attached within " +
+                                 std::to_string(reader_timeout_.count()) + " seconds");
+    }
+}
+
+void ShmRingWriter::commit() {
+    position_ = end_position_;
+    control_->write_position.store(position_);
+    control_->data_futex.fetch_add(1);
+    if (control_->reader_waiting.exchange(0)) wakeAll(control_->data_futex);
+}
+
+ShmRingReader::ShmRingReader(const std::string &name, unsigned int timeout_ms)
+    : name_(name)
+    , mapping_(nullptr)
+    , mapping_size_(0)
+    , control_(nullptr)
+    , data_(nullptr)
+    , position_(0)
+    , next_position_(0) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        int fd = shm_open(name_.c_str(), O_RDWR, 0);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size > CONTROL_SIZE) {
+            void *mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                throw std::runtime_error("Failed to map shared memory " + name_ + ": " + strerror(errno));
+            }
+            mapping_ = static_cast<char *>(mapping);
+            mapping_size_ = st.st_size;
+            control_ = reinterpret_cast<ShmRingControl *>(mapping_);
+            if (control_->magic.load() == SHM_RING_MAGIC) break;
+            // Created but not initialized yet
+            munmap(mapping_, mapping_size_);
+            mapping_ = nullptr;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            throw std::runtime_error("Shared memory " + name_ + " was not created in time");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (control_->version != SHM_RING_VERSION || control_->data_offset + control_->capacity != mapping_size_) {
+        munmap(mapping_, mapping_size_);
+        throw std::runtime_error("Shared memory " + name_ + " does not hold a ring of this version");
+    }
+    // A single reader at a time, one left behind by a process that exited is replaced
+    uint32_t pid = static_cast<uint32_t>(getpid());
+    uint32_t attached = control_->reader_pid.load();
+    do {
+        if (attached != 0 && attached != pid && processAlive(attached)) {
+            munmap(mapping_, mapping_size_);
+            throw std::runtime_error("Shared memory " + name_ + " is read by process " + std::to_string(attached) +
+                                     " already");
+        }
+    } while (!control_->reader_pid.compare_exchange_weak(attached, pid));
+    data_ = mapping_ + control_->data_offset;
+    position_ = next_position_ = control_->read_position.load();
+}
+
+ShmRingReader::~ShmRingReader() {
+    uint32_t pid = static_cast<uint32_t>(getpid());
+    control_->reader_pid.compare_exchange_strong(pid, 0);
+    if (control_->writer_closed.load() && control_->read_position.load() == control_->write_position.load()) {
+        shm_unlink(name_.c_str());
+    }
+    munmap(mapping_, mapping_size_);
+}
+
+bool ShmRingReader::next(ShmRecord &record) {
+    position_ = next_position_;
+    for (;;) {
+        if (control_->write_position.load() == position_) {
+            // Everything is published before the ring is closed
+            if (control_->writer_closed.load()) {
+                if (control_->write_position.load() == position_) return false;
+                continue;
+            }
+            uint32_t published = control_->data_futex.load();
+            control_->reader_waiting.store(1);
+            if (control_->write_position.load() == position_ && !control_->writer_closed.load()) {
+                waitOn(control_->data_futex, published);
+            }
+            continue;
+        }
+
+        const ShmRecordHeader *header =
+            reinterpret_cast<const ShmRecordHeader *>(data_ + position_ % control_->capacity);
+        uint64_t stride = shmAlign(sizeof(ShmRecordHeader) + header->size);
+        if (header->type == static_cast<uint32_t>(ShmRecordType::PADDING)) {
+            next_position_ = position_ + stride;
+            release();
+            position_ = next_position_;
+            continue;
+        }
+        record.type = static_cast<ShmRecordType>(header->type);
+        record.payload = reinterpret_cast<const char *>(header + 1);
+        record.size = header->size;
+        next_position_ = position_ + stride;
+        return true;
+    }
+}
+
+void ShmRingReader::release() {
+    control_->read_position.store(next_position_);
+    control_->space_futex.fetch_add(1);
+    if (control_->writer_waiting.exchange(0)) wakeAll(control_->space_futex);
+}
+
+#else
+
+ShmRingWriter::ShmRingWriter(const std::string &name, size_t, unsigned int)
+    : name_(name), reader_timeout_(0), mapping_(nullptr), mapping_size_(0), control_(nullptr), data_(nullptr), position_(0),
+      end_position_(0) {
+    throw std::runtime_error("Shared memory rings are not supported on this platform");
+}
+
+ShmRingWriter::~ShmRingWriter() {}
+
+char *ShmRingWriter::begin(ShmRecordType, size_t) { return nullptr; }
+
+void ShmRingWriter::checkReader(std::chrono::steady_clock::time_point) const {}
+
+void ShmRingWriter::commit() {}
+
+ShmRingReader::ShmRingReader(const std::string &name, unsigned int)
+    : name_(name), mapping_(nullptr), mapping_size_(0), control_(nullptr), data_(nullptr), position_(0),
+      next_position_(0) {
+    throw std::runtime_error("Shared memory rings are not supported on this platform");
+}
+
+ShmRingReader::~ShmRingReader() {}
+
+bool ShmRingReader::next(ShmRecord &) { return false; }
+
+void ShmRingReader::release() {}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "ismrmrd/ismrmrd.h"
+
+// A single producer / single consumer ring of records in POSIX shared memory. The converter
+// publishes the measurement into it (see ShmOutput), a reconstruction on the same node maps it
+// and reads the records in place. This header and shmring.cpp are the consumer library.
+//
+// A measurement is a HEADER record, ACQUISITION and WAVEFORM records in conversion order,
+// possibly another HEADER record replacing the first one, and an END record. Several
+// measurements may follow each other in one ring.
+//
+// Both sides wait on futexes in the shared control block: the reader when the ring is empty,
+// the writer when it is full, which keeps a slow reader from being overrun. Other systems than
+// Linux poll instead. The reader records its process id in the control block, so a writer facing
+// a full ring notices when the reader has exited, or when none attaches in time, and gives up.
+// Writer and reader have to share a PID namespace.
+
+/// Kinds of records in the ring
+enum class ShmRecordType : uint32_t {
+    PADDING = 0,     // Rest of the ring before it wraps around, skipped by ShmRingReader
+    HEADER = 1,      // ISMRMRD XML header. A later one updates the header of the measurement.
+    ACQUISITION = 2, // ISMRMRD acquisition, see ShmAcquisition
+    WAVEFORM = 3,    // ISMRMRD waveform header, then the uint32 samples
+    END = 4          // End of the measurement, no payload
+};
+
+/// Records start at multiples of this many bytes in the ring
+const size_t SHM_RING_ALIGNMENT = 64;
+
+inline size_t shmAlign(size_t n) {
+    return (n + SHM_RING_ALIGNMENT - 1) & ~(SHM_RING_ALIGNMENT - 1);
+}
+
+/// Start of every record, the payload follows right after it
+struct ShmRecordHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t size; // Payload bytes
+};
+
+/// Control block at the start of the shared memory object, the records follow at data_offset
+struct ShmRingControl {
+    std::atomic<uint32_t> magic; // Set once the writer has initialized the ring
+    uint32_t version;
+    uint64_t capacity;    // Bytes of the record area, a multiple of SHM_RING_ALIGNMENT
+    uint64_t data_offset;
+
+    // Positions count bytes since the ring was created, the offset in the ring is position % capacity
+    alignas(64) std::atomic<uint64_t> write_position; // Everything before it is published
+    std::atomic<uint32_t> data_futex;                  // Bumped whenever records are published
+    std::atomic<uint32_t> reader_waiting;
+    alignas(64) std::atomic<uint64_t> read_position;  // Everything before it is released by the reader
+    std::atomic<uint32_t> space_futex;                 // Bumped whenever records are released
+    std::atomic<uint32_t> writer_waiting;
+    alignas(64) std::atomic<uint32_t> writer_closed;  // No more records will be published
+    std::atomic<uint32_t> reader_pid;                  // Process id of the attached reader, 0 without one
+};
+
+/// Pointers into an ACQUISITION record. The acquisition header comes first, then the trajectory
+/// (trajectory_dimensions floats per sample). The samples start SHM_RING_ALIGNMENT aligned, all
+/// samples of the first active channel, then the next channel, as in ISMRMRD::Acquisition.
+struct ShmAcquisition {
+    const ISMRMRD::AcquisitionHeader *head;
+    const float *traj;
+    const complex_float_t *data;
+
+    /// Offset of the samples from the start of the record
+    static size_t dataOffset(size_t traj_bytes) {
+        return shmAlign(sizeof(ShmRecordHeader) + sizeof(ISMRMRD::AcquisitionHeader) + traj_bytes);
+    }
+};
+
+/// A record as returned by ShmRingReader::next, pointing into the shared memory
+struct ShmRecord {
+    ShmRecordType type;
+    const char *payload;
+    size_t size;
+
+    /// For ACQUISITION records
+    ShmAcquisition acquisition() const;
+    /// For HEADER records
+    std::string xml() const { return std::string(payload, size); }
+};
+
+/// Creates the ring and publishes records into it. Used by a single thread.
+class ShmRingWriter {
+public:
+    /// Creates the shared memory object name (e.g. "/siemens_to_ismrmrd") with room for capacity bytes of
+    /// records, replacing an object of that name left behind earlier. The object stays after the writer is
+    /// closed, the reader removes it once it has read everything.
+    /// While the ring is full and no reader is attached, begin waits up to reader_timeout_s seconds for one.
+    ShmRingWriter(const std::string &name, size_t capacity, unsigned int reader_timeout_s = 60);
+    ~ShmRingWriter();
+
+    ShmRingWriter(const ShmRingWriter &) = delete;
+    ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+    /// Starts a record of size payload bytes and returns its payload, waiting until the reader has
+    /// released enough of the ring. Throws if the record can never fit, if the reader has exited, or if
+    /// no reader has attached within the timeout.
+    char *begin(ShmRecordType type, size_t size);
+
+    /// Publishes the record started last
+    void commit();
+
+    const std::string &name() const { return name_; }
+
+private:
+    /// Removes the ring and throws if the reader is gone, or if there has been none since waiting_since for
+    /// the timeout
+    void checkReader(std::chrono::steady_clock::time_point waiting_since) const;
+
+    std::string name_;
+    std::chrono::seconds reader_timeout_;
+    char *mapping_;
+    size_t mapping_size_;
+    ShmRingControl *control_;
+    char *data_;
+    uint64_t position_;     // Position of the next record
+    uint64_t end_position_; // End of the record started last
+};
+
+/// Maps a ring created by ShmRingWriter and reads its records in place. Used by a single thread.
+class ShmRingReader {
+public:
+    /// Opens the shared memory object name, waiting up to timeout_ms for the writer to create it.
+    /// Throws if another live process is reading the ring already.
+    explicit ShmRingReader(const std::string &name, unsigned int timeout_ms = 10000);
+    /// Removes the shared memory object if the writer has closed the ring and everything has been read
+    ~ShmRingReader();
+
+    ShmRingReader(const ShmRingReader &) = delete;
+    ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+    /// Waits for the next record and returns false once the writer has closed the ring and all records
+    /// are read. The record stays valid, and the writer can not reuse its space, until release is called.
+    bool next(ShmRecord &record);
+
+    /// Releases the record returned by next
+    void release();
+
+private:
+    std::string name_;
+    char *mapping_;
+    size_t mapping_size_;
+    ShmRingControl *control_;
+    const char *data_;
+    uint64_t position_;      // Position of the record returned by next
+    uint64_t next_position_; // Position after it
+};
+
+#endif //SHMRING_H_
@@ -18,6 +18,9 @@
 #define MDH_PACK_BIT_MASK     (0x02000000L)
 #define MDH_ENABLE_FLAGS_MASK (0xFC000000L)
 #define MDH_SYNCDATA (0x00000020L)
+#define MDH_PHASCOR (0x00200000L)
+#define MDH_PATREFSCAN (0x00400000L)
+#define MDH_NOISEADJSCAN (0x02000000L)
 
 enum class PMU_Type {
 	END =  0x01FF0000,